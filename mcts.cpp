@@ -8,8 +8,21 @@
 #include <algorithm>
 #include <cstdlib>
 #include <cmath>
+#include <climits>
+#include <cstdint>
 #include <chrono>
 #include <ctime>
+#include <thread>
+#include <atomic>
+#include <immintrin.h>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #define cerr std::cerr
 #define endl std::endl
@@ -27,20 +40,22 @@ inline TimePoint now() {
 		(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 #define USE_LOGINT
+//#define USE_STATS // Search instrumentation, see Statistics
 // Types
 using slowminiboard_t = int[9]; // Encoded as 0 1 or 2 for every position
 using miniboard_t = int; // Encoded as a "Board position" in base 3
 using board_t = miniboard_t[9]; // Encoded as 9 mini boards
 using move_t = int; // Encoded as integer from 0 -> 81 indicated where to place a stone
 using movelist_t = std::vector<move_t>;
-struct mcnode_t;
+using node_t = unsigned int; // Index of a node in MEMORY
+using bitboard_t = unsigned __int128; // A set of cells, bit 9 * miniboard + cell as indexed by movegen_to_move
+// Node data not needed to pick a child, statistics live in the VISITS and SCORE arrays
 typedef struct mcnode_t {
-	mcnode_t *next;
-	mcnode_t *child;
-	mcnode_t *parent; // TODO use info from selection
-	int visits, player;
-	move_t mv;
-	float mean, upper, invsqrtvisits;
+	node_t child; // First child, the children of a node are contiguous
+	unsigned char nchild; // 0 for a leaf
+	signed char mv;
+	signed char player;
+	char expanding; // Set by the thread expanding this node
 } mcnode_t;
 
 // Consts
@@ -50,36 +65,528 @@ const int BLACK_WIN = 2;
 const int EGALITY = 0;
 const int NOT_OVER = -1;
 const int NULL_MOVE = -1;
-const int MEMSIZE = 500'000'000;
-const int OBJ_SIZE = MEMSIZE / sizeof(mcnode_t);
+const node_t NULL_NODE = 0xFFFFFFFF;
+const int MAX_DEPTH = 82; // Root and at most 81 moves
+const int NODE_BYTES = sizeof(mcnode_t) + 2 * sizeof(int) + sizeof(signed char); // MEMORY, VISITS, SCORE and PROVEN
+const int AMAF_BYTES = 2 * sizeof(int); // AMAF_VISITS and AMAF_SCORE, with RAVE
 float FPU_C = 1.2f;
 float C = 0.7f;
+bool RAVE = false; // See RAVE
+float RAVE_K = 50;
 
 const int POW_THREE[9] = { 1, 3, 3 * 3, 3 * 3 * 3, 3 * 3 * 3 * 3, 3 * 3 * 3 * 3 * 3, 3 * 3 * 3 * 3 * 3 * 3, 3 * 3 * 3 * 3 * 3 * 3 * 3, 3 * 3 * 3 * 3 * 3 * 3 * 3 * 3 };
 const int POPCNT[512] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8, 1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8, 2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8, 3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7, 4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8, 4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8, 5, 6, 6, 7, 6, 7, 7, 8, 6, 7, 7, 8, 7, 8, 8, 9 };
-int RD_POS[512 * 9];
-int max_from_move[81]; // Get max board id for board_t from move_t
-int min_from_move[81]; // Get which miniboard move was played on
-move_t movegen_to_move[81];
+// Tables
+// Built by constexpr functions at compile time, so they live in read-only data and nothing runs at startup
 
-movelist_t empty_from_miniboard[BOARD_POSITIONS]; // get empty spaces from miniboards
-unsigned long long emptybits_from_miniboard[BOARD_POSITIONS]; // get empty spaces from miniboards
-int nb_emptybits_from_miniboard[BOARD_POSITIONS]; // get empty spaces from miniboards
+constexpr void fast_to_slow(miniboard_t mini, slowminiboard_t value) {
+	for (int i = 0; i < 9; i++) {
+		value[i] = mini % 3;
+		mini /= 3;
+	}
+}
+
+constexpr int get_winner(const slowminiboard_t mini) {
+	for (int i = 0; i < 3; i++) {
+		if (mini[i] != 0 && mini[i] == mini[i + 3] && mini[i] == mini[i + 6]) {
+			return mini[i];
+		}
+		if (mini[i * 3] != 0 && mini[i * 3] == mini[i * 3 + 1] && mini[i * 3] == mini[i * 3 + 2]) {
+			return mini[i * 3];
+		}
+	}
+	if (mini[4] != 0) {
+		if (mini[0] == mini[4] && mini[0] == mini[8])
+			return mini[4];
+		if (mini[2] == mini[4] && mini[2] == mini[6])
+			return mini[4];
+	}
+	for (int i = 0; i < 9; i++) {
+		if (mini[i] == 0) {
+			return NOT_OVER;
+		}
+	}
+	return EGALITY;
+}
+
+struct move_tables_t {
+	int max[81];
+	int min[81];
+	move_t movegen[81];
+};
+
+constexpr move_tables_t make_move_tables() {
+	move_tables_t t = {};
+	for (int i = 0; i < 81; i++) {
+		t.max[i] = i % 3 + 3 * ((i % 27) / 9);
+		t.min[i] = (i % 9) / 3 + 3 * (i / 27);
+		t.movegen[i] = t.max[i] + t.min[i] * 9;
+	}
+	return t;
+}
+
+struct miniboard_tables_t {
+	int state[BOARD_POSITIONS];
+	unsigned long long emptybits[BOARD_POSITIONS];
+	int nb_emptybits[BOARD_POSITIONS];
+	int stones[BOARD_POSITIONS][2];
+	int wins[BOARD_POSITIONS][2];
+	signed char empty[BOARD_POSITIONS][9];
+};
+
+constexpr int LINES[8] = { 0x7, 0x38, 0x1C0, 0x49, 0x92, 0x124, 0x111, 0x54 };
+
+// Empty cells completing a line of mine
+constexpr int winning_cells(int mine, int empty) {
+	int cells = 0;
+	for (int line : LINES) {
+		int missing = line & ~mine;
+		if ((missing & (missing - 1)) == 0 && (missing & empty)) {
+			cells |= missing;
+		}
+	}
+	return cells;
+}
+
+constexpr miniboard_tables_t make_miniboard_tables() {
+	miniboard_tables_t t = {};
+	for (int i = 0; i < BOARD_POSITIONS; i++) {
+		int val[9] = {};
+		fast_to_slow(i, val);
+		t.state[i] = get_winner(val);
+		for (int j = 0; j < 9; j++) {
+			if (val[j] == 0) {
+				t.emptybits[i] |= 1 << j;
+				t.empty[i][t.nb_emptybits[i]++] = j % 3 + (j / 3) * 9;
+			}
+			else {
+				t.stones[i][val[j] - 1] |= 1 << j;
+			}
+		}
+		if (t.state[i] == NOT_OVER) {
+			t.wins[i][0] = winning_cells(t.stones[i][0], t.emptybits[i]);
+			t.wins[i][1] = winning_cells(t.stones[i][1], t.emptybits[i]);
+		}
+	}
+	return t;
+}
+
+struct bit_tables_t {
+	int rd_pos[512 * 9];
+	bool line[512];
+	int threat[512];
+	int log2[1024];
+};
+
+constexpr bit_tables_t make_bit_tables() {
+	bit_tables_t t = {};
+	for (int j = 0; j < 512; j++) {
+		int counter = 0;
+		for (int i = 0; i < 9; i++) {
+			t.rd_pos[i * 512 + j] = -1;
+		}
+		for (int i = 0; i < 9; i++) {
+			if ((j >> i) & 1) {
+				t.rd_pos[counter * 512 + j] = i;
+				counter++;
+			}
+		}
+		int val[9] = {};
+		for (int i = 0; i < 9; i++) {
+			val[i] = (j >> i) & 1;
+		}
+		t.line[j] = get_winner(val) == 1;
+		t.threat[j] = winning_cells(j, ~j & 0x1FF);
+	}
+	for (int i = 2; i < 1024; i++) {
+		t.log2[i] = t.log2[i / 2] + 1;
+	}
+	return t;
+}
+
+constexpr move_tables_t MOVE_TABLES = make_move_tables();
+constexpr miniboard_tables_t MINIBOARD_TABLES = make_miniboard_tables();
+constexpr bit_tables_t BIT_TABLES = make_bit_tables();
+
+constexpr auto& RD_POS = BIT_TABLES.rd_pos; // Index of the n-th set bit of a 9 bit mask at n * 512 + mask
+constexpr auto& max_from_move = MOVE_TABLES.max; // Get max board id for board_t from move_t
+constexpr auto& min_from_move = MOVE_TABLES.min; // Get which miniboard move was played on
+constexpr auto& movegen_to_move = MOVE_TABLES.movegen;
+
+constexpr auto& empty_from_miniboard = MINIBOARD_TABLES.empty; // get empty spaces from miniboards, as move offsets in the miniboard
+constexpr auto& emptybits_from_miniboard = MINIBOARD_TABLES.emptybits; // get empty spaces from miniboards
+constexpr auto& nb_emptybits_from_miniboard = MINIBOARD_TABLES.nb_emptybits; // get empty spaces from miniboards
+
+constexpr auto& state_from_miniboard = MINIBOARD_TABLES.state; // get win info on miniboard
+constexpr auto& stones_from_miniboard = MINIBOARD_TABLES.stones; // get cells of play id 1 and 2 as 9 bit masks
+constexpr auto& wins_from_miniboard = MINIBOARD_TABLES.wins; // get empty cells winning an open miniboard for play id 1 and 2
+constexpr auto& line_from_bits = BIT_TABLES.line; // does a 9 bit mask contain a line
+constexpr auto& threat_from_bits = BIT_TABLES.threat; // cells outside a 9 bit mask completing a line with it
+unsigned long long zobrist_from_stone[81][3]; // indexed by 9 * miniboard + cell and play id
+unsigned long long zobrist_from_forced[10]; // miniboard the next move is forced in, 9 for any
+unsigned long long zobrist_player; // player 1 made the last move
+
+// Mapped by init_arena
+mcnode_t* MEMORY;
+int* VISITS; // Includes the virtual losses of playouts still running below the node
+int* SCORE; // Sum of playout results in half points: 2 for a win, 1 for a draw
+// All moves as first statistics, only mapped with RAVE set before init_arena
+int* AMAF_VISITS;
+int* AMAF_SCORE;
+// MCTS-Solver: game theoretic value of a node for the player who made its move, 1 + half points once known
+const signed char UNPROVEN = 0;
+const signed char PROVEN_LOSS = 1;
+const signed char PROVEN_DRAW = 2;
+const signed char PROVEN_WIN = 3;
+signed char* PROVEN;
+
+// Transposition table
+// Maps a position to the child block of the first node expanded there, every move order
+// reaching it then shares the children and their statistics: the tree becomes a DAG.
+// Slots are only claimed while empty, a published entry does not change until tt_clear.
+struct tt_entry_t {
+	unsigned long long key; // 0 for an empty slot
+	unsigned long long data; // nchild << 32 | child, 0 until published
+};
+const int TT_BITS = 20;
+const int TT_SIZE = 1 << TT_BITS;
+const int TT_PROBES = 8;
+tt_entry_t TT[TT_SIZE];
+// Off by default: moves are forced into the miniboard picked by the previous move, so two move orders
+// rarely reach the same position and the table costs more than it saves on bench()
+bool USE_TT = false;
+bool tt_active = USE_TT; // Also off during root parallel search, the trees must stay separate
+std::atomic<int> tt_hits(0);
+std::atomic<bool> tt_used(false); // Set by the first store since tt_clear, the table is 16MB
+
+void tt_clear() {
+	if (tt_used.load(std::memory_order_relaxed)) {
+		std::fill(TT, TT + TT_SIZE, tt_entry_t{ 0, 0 });
+		tt_used.store(false, std::memory_order_relaxed);
+	}
+}
+
+// Returns false if the position is not there or still being published
+inline bool tt_probe(unsigned long long key, node_t& child, int& nchild) {
+	for (int i = 0; i < TT_PROBES; i++) {
+		tt_entry_t& e = TT[((key >> (64 - TT_BITS)) + i) & (TT_SIZE - 1)];
+		unsigned long long k = __atomic_load_n(&e.key, __ATOMIC_RELAXED);
+		if (k == 0) {
+			return false;
+		}
+		if (k == key) {
+			unsigned long long data = __atomic_load_n(&e.data, __ATOMIC_ACQUIRE);
+			child = (node_t)data;
+			nchild = data >> 32;
+			return data != 0;
+		}
+	}
+	return false;
+}
+
+// Does nothing if the position is already there or all its slots are taken
+inline void tt_store(unsigned long long key, node_t child, int nchild) {
+	for (int i = 0; i < TT_PROBES; i++) {
+		tt_entry_t& e = TT[((key >> (64 - TT_BITS)) + i) & (TT_SIZE - 1)];
+		unsigned long long k = __atomic_load_n(&e.key, __ATOMIC_RELAXED);
+		if (k == 0) {
+			if (__atomic_compare_exchange_n(&e.key, &k, key, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				if (!tt_used.load(std::memory_order_relaxed)) {
+					tt_used.store(true, std::memory_order_relaxed);
+				}
+				__atomic_store_n(&e.data, ((unsigned long long)nchild << 32) | child, __ATOMIC_RELEASE);
+				return;
+			}
+		}
+		if (k == key) {
+			return;
+		}
+	}
+}
+
+// Statistics
+// With USE_STATS every search thread fills its own search_stats_t, which is added to search_stats
+// when the thread is done. get_best_move dumps them as one JSON line per move on stderr, pondering
+// included. Without USE_STATS the STAT macro drops its argument and nothing is measured.
+#ifdef USE_STATS
+#define STAT(...) __VA_ARGS__
+#else
+#define STAT(...)
+#endif
+
+enum stat_phase_t { PHASE_SELECT, PHASE_EXPAND, PHASE_SOLVER, PHASE_ROLLOUT, PHASE_BACKPROP, NB_PHASES };
+const char* STAT_PHASE_NAMES[NB_PHASES] = { "select", "expand", "solver", "rollout", "backprop" };
+
+struct search_stats_t {
+	long long cycles[NB_PHASES]; // rdtsc ticks summed over threads
+	long long depth[MAX_DEPTH + 1]; // Playouts by selection depth
+	long long rollout[82]; // Rollouts by length in plies, averaged over the lanes of a batch
+	long long branching[82]; // Expanded nodes by number of children
+	long long plies; // Rollout plies played so far, the kernels only count
+	long long slice_chunks; // Chunks taken from root parallel slices
+	long long ticks; // rdtsc ticks and microseconds spent in run_search, to convert cycles
+	long long micros;
+};
+
+search_stats_t search_stats;
+thread_local search_stats_t thread_stats;
+
+void merge_stats() {
+	long long* from = (long long*)&thread_stats;
+	long long* to = (long long*)&search_stats;
+	for (int i = 0; i < (int)(sizeof(search_stats_t) / sizeof(long long)); i++) {
+		__atomic_add_fetch(&to[i], from[i], __ATOMIC_RELAXED);
+	}
+	thread_stats = search_stats_t();
+}
+
+// Adds the ticks since t to phase and restarts t
+inline void stat_lap(unsigned long long& t, int phase) {
+	unsigned long long c = __rdtsc();
+	thread_stats.cycles[phase] += c - t;
+	t = c;
+}
+
+// Every thread allocates from its own chunk of MEMORY, only taking a new chunk touches shared state.
+// The arena never wraps: once its chunks are gone allocate returns NULL_NODE, the search then
+// keeps doing rollouts from the leaves it has, and with recycling on prunes its least visited
+// subtrees. Their blocks go to the free lists of the thread, which allocate serves first.
+const int CHUNK_SIZE = 4096;
+int NB_CHUNKS = 0; // Set by init_arena
+std::atomic<long long> MEMORY_CHUNK(0); // Next chunk to hand out, NB_CHUNKS or more once the arena is full
+int MEMORY_EPOCH = 0; // Bumped when the arena is rearranged, invalidating all thread chunks and free lists
+thread_local int chunk_ptr = 0;
+thread_local int chunk_end = 0;
+thread_local int chunk_epoch = -1;
+// A thread with a slice only takes chunks from it and never touches MEMORY_CHUNK
+thread_local int slice_first = 0;
+thread_local int slice_chunks = 0;
+thread_local int slice_next = 0;
+// Freed child blocks by size, linked through the child field of their first node
+thread_local node_t free_blocks[82];
+thread_local long long free_nodes = 0;
+thread_local int free_epoch = -1;
+thread_local bool arena_exhausted = false; // An allocation failed since the last prune
+// Only a thread searching a tree alone may free its nodes
+bool recycle_active = false;
+std::atomic<long long> arena_failures(0); // Allocations refused since startup
+std::atomic<long long> arena_prunes(0);
+std::atomic<long long> arena_freed(0); // Nodes returned to the free lists by pruning
+
+bool refill_chunk() {
+	int chunk;
+	if (slice_chunks > 0) {
+		if (slice_next >= slice_chunks) {
+			return false;
+		}
+		chunk = slice_first + slice_next++;
+		STAT(thread_stats.slice_chunks++);
+	}
+	else {
+		long long k = MEMORY_CHUNK.fetch_add(1, std::memory_order_relaxed);
+		if (k >= NB_CHUNKS) {
+			return false;
+		}
+		chunk = k;
+	}
+	chunk_ptr = chunk * CHUNK_SIZE;
+	chunk_end = chunk_ptr + CHUNK_SIZE;
+	chunk_epoch = MEMORY_EPOCH;
+	return true;
+}
+
+// Restarts allocation at first_chunk, nothing may be allocated concurrently
+void reset_arena(int first_chunk) {
+	MEMORY_CHUNK = first_chunk;
+	MEMORY_EPOCH++;
+	tt_clear();
+}
+
+// nb_chunks = 0 goes back to the shared arena
+void set_arena_slice(int first_chunk, int nb_chunks) {
+	slice_first = first_chunk;
+	slice_chunks = nb_chunks;
+	slice_next = 0;
+	chunk_epoch = -1;
+}
+
+// Nodes allocated since reset_arena(0), for a single threaded caller
+long long arena_used() {
+	long long used = std::min(MEMORY_CHUNK.load(), (long long)NB_CHUNKS) * CHUNK_SIZE;
+	if (chunk_epoch == MEMORY_EPOCH && slice_chunks == 0) {
+		used -= chunk_end - chunk_ptr;
+	}
+	return used;
+}
+
+// Nodes the calling thread may allocate from chunks
+long long arena_capacity() {
+	return (slice_chunks > 0 ? slice_chunks : NB_CHUNKS) * (long long)CHUNK_SIZE;
+}
+
+void free_block(node_t first, int n) {
+	if (free_epoch != MEMORY_EPOCH) {
+		std::fill(free_blocks, free_blocks + 82, NULL_NODE);
+		free_nodes = 0;
+		free_epoch = MEMORY_EPOCH;
+	}
+	MEMORY[first].child = free_blocks[n];
+	free_blocks[n] = first;
+	free_nodes += n;
+}
+
+// Smallest free block of at least n nodes, the rest of it is freed again
+node_t reuse_block(int n) {
+	for (int size = n; size < 82; size++) {
+		node_t first = free_blocks[size];
+		if (first != NULL_NODE) {
+			free_blocks[size] = MEMORY[first].child;
+			free_nodes -= size;
+			if (size > n) {
+				free_block(first + n, size - n);
+			}
+			return first;
+		}
+	}
+	return NULL_NODE;
+}
+
+// Returns the first of n contiguous nodes, NULL_NODE when the arena is full
+inline node_t allocate(int n) {
+	if (free_nodes && free_epoch == MEMORY_EPOCH) {
+		node_t first = reuse_block(n);
+		if (first != NULL_NODE) {
+			return first;
+		}
+	}
+	if (chunk_ptr + n > chunk_end || chunk_epoch != MEMORY_EPOCH) {
+		if (!refill_chunk()) {
+			arena_exhausted = true;
+			arena_failures.fetch_add(1, std::memory_order_relaxed);
+			return NULL_NODE;
+		}
+	}
+	node_t first = chunk_ptr;
+	chunk_ptr += n;
+	return first;
+}
+
+// Arena memory
+// The node arrays are anonymous mappings of ARENA_BYTES in total, made at startup.
+// Pages are committed on their first write: prefaulting writes them all before the first clock starts,
+// each of the given threads taking the slice a root parallel worker gets from an empty arena.
+// The kernel places a page on the NUMA node of the thread that first wrote it.
+long long ARENA_BYTES = 500'000'000;
+bool HUGE_PAGES = true; // Explicit huge pages when enough are reserved, transparent ones otherwise
+bool PREFAULT_ARENA = false; // About 1s per GB, only worth it when startup is not on the clock
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+struct arena_map_t {
+	void* base;
+	size_t length;
+};
+arena_map_t arena_maps[6];
+int explicit_huge_maps = 0;
+
+// Maps at least length bytes aligned on a huge page
+void* map_arena_array(arena_map_t& map, size_t length) {
+	length = (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	if (HUGE_PAGES) {
+		void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			map = { p, length };
+			explicit_huge_maps++;
+			return p;
+		}
+	}
+	map.length = length + HUGE_PAGE_SIZE;
+	map.base = mmap(nullptr, map.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map.base == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	void* p = (void*)(((uintptr_t)map.base + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+	if (HUGE_PAGES) {
+		madvise(p, length, MADV_HUGEPAGE);
+	}
+	return p;
+}
+
+template<typename T>
+void prefault_range(T* array, long long first, long long end) {
+	const long long step = 4096 / sizeof(T);
+	for (long long i = first; i < end; i += step) {
+		array[i] = T();
+	}
+}
+
+void prefault_chunks(int first_chunk, int end_chunk) {
+	long long first = (long long)first_chunk * CHUNK_SIZE;
+	long long end = (long long)end_chunk * CHUNK_SIZE;
+	prefault_range(MEMORY, first, end);
+	prefault_range(VISITS, first, end);
+	prefault_range(SCORE, first, end);
+	prefault_range(PROVEN, first, end);
+	if (RAVE) {
+		prefault_range(AMAF_VISITS, first, end);
+		prefault_range(AMAF_SCORE, first, end);
+	}
+}
 
-int state_from_miniboard[BOARD_POSITIONS]; // get win info on miniboard
+// Maps an arena of about bytes, dropping the previous one and the tree in it.
+// prefault_threads = 0 leaves the pages to be committed by the search
+void init_arena(long long bytes, int prefault_threads) {
+	for (arena_map_t& map : arena_maps) {
+		if (map.base) {
+			munmap(map.base, map.length);
+		}
+		map = { nullptr, 0 };
+	}
+	explicit_huge_maps = 0;
+	long long nodes = std::min(bytes / (NODE_BYTES + (RAVE ? AMAF_BYTES : 0)), (long long)INT_MAX - CHUNK_SIZE);
+	NB_CHUNKS = std::max(nodes / CHUNK_SIZE, 1LL);
+	nodes = (long long)NB_CHUNKS * CHUNK_SIZE;
+	MEMORY = (mcnode_t*)map_arena_array(arena_maps[0], nodes * sizeof(mcnode_t));
+	VISITS = (int*)map_arena_array(arena_maps[1], nodes * sizeof(int));
+	SCORE = (int*)map_arena_array(arena_maps[2], nodes * sizeof(int));
+	PROVEN = (signed char*)map_arena_array(arena_maps[3], nodes * sizeof(signed char));
+	AMAF_VISITS = RAVE ? (int*)map_arena_array(arena_maps[4], nodes * sizeof(int)) : nullptr;
+	AMAF_SCORE = RAVE ? (int*)map_arena_array(arena_maps[5], nodes * sizeof(int)) : nullptr;
+	reset_arena(0);
+	if (prefault_threads > 0) {
+		int slice = NB_CHUNKS / prefault_threads;
+		std::vector<std::thread> workers;
+		for (int i = 1; i < prefault_threads; i++) {
+			workers.emplace_back(prefault_chunks, i * slice, i + 1 == prefault_threads ? NB_CHUNKS : (i + 1) * slice);
+		}
+		prefault_chunks(0, prefault_threads == 1 ? NB_CHUNKS : slice);
+		for (auto& w : workers) {
+			w.join();
+		}
+	}
+}
 
-void fast_to_slow(miniboard_t mini, slowminiboard_t value);
-int get_winner(slowminiboard_t mini);
+// Shared tree statistics are updated with relaxed atomics, the tree shape is published with release/acquire
+template<typename T>
+inline T load_relaxed(T& v) {
+	T r;
+	__atomic_load(&v, &r, __ATOMIC_RELAXED);
+	return r;
+}
 
-mcnode_t MEMORY[OBJ_SIZE];
-int MEMORY_PTR = 0;
+template<typename T>
+inline void store_relaxed(T& v, T r) {
+	__atomic_store(&v, &r, __ATOMIC_RELAXED);
+}
 
-inline mcnode_t* allocate() {
-	MEMORY_PTR = (MEMORY_PTR + 1) % OBJ_SIZE;
-	return &MEMORY[MEMORY_PTR];
+// child is written before nchild is released
+inline int load_nchild(node_t node) {
+	return __atomic_load_n(&MEMORY[node].nchild, __ATOMIC_ACQUIRE);
 }
 
-static unsigned long x = 123456789, y = 362436069, z = 521288629;
+inline float node_mean(node_t node) {
+	int visits = load_relaxed(VISITS[node]);
+	return visits > 0 ? load_relaxed(SCORE[node]) * 0.5f / visits : 0;
+}
 
 const int tab32[32] = {
 	0,  9,  1, 10, 13, 21,  2, 29,
@@ -87,8 +594,12 @@ const int tab32[32] = {
 	8, 12, 20, 28, 15, 17, 24,  7,
 	19, 27, 23,  6, 26,  5,  4, 31 };
 
+const int INVSQRT_SIZE = 4096;
+float invsqrt_from_visits[INVSQRT_SIZE]; // 1 / sqrt(n)
+
 #ifdef USE_LOGINT
-int firstlog1024[1024];
+constexpr auto& firstlog1024 = BIT_TABLES.log2;
+float sqrt_from_log[32]; // sqrt(n) for every possible log2_32 result
 
 int log2_32(uint32_t value)
 {
@@ -104,18 +615,58 @@ int log2_32(uint32_t value)
 }
 #endif
 
-unsigned long fast_rand(void) {          //period 2^96-1
-	unsigned long t;
-	x ^= x << 16;
-	x ^= x >> 5;
-	x ^= x << 1;
+// Random numbers
+// xorshift128+ with its state in an rng_t. Every thread draws from its own thread_rng: search
+// threads are seeded from the rng of the thread starting them, so seeding the main thread makes a
+// single threaded run reproducible. Bounded draws use a multiply-shift instead of a modulo.
+struct rng_t {
+	unsigned long long s[2];
+};
+
+thread_local rng_t thread_rng = { { 0x9E3779B97F4A7C15ULL, 0xBF58476D1CE4E5B9ULL } };
+
+// splitmix64 spreads seed over the state, which is never all zero
+void seed_rng(rng_t& r, unsigned long long seed) {
+	for (int i = 0; i < 2; i++) {
+		seed += 0x9E3779B97F4A7C15ULL;
+		unsigned long long z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		r.s[i] = z ^ (z >> 31);
+	}
+}
+
+inline unsigned long long rng_next(rng_t& r) {
+	unsigned long long a = r.s[0];
+	const unsigned long long b = r.s[1];
+	r.s[0] = b;
+	a ^= a << 23;
+	r.s[1] = a ^ b ^ (a >> 17) ^ (b >> 26);
+	return r.s[1] + b;
+}
+
+// Scales a 32 bit random number to [0, n)
+inline unsigned int bounded(unsigned int rd, unsigned int n) {
+	return ((unsigned long long)rd * n) >> 32;
+}
+
+inline unsigned int rng_below(rng_t& r, unsigned int n) {
+	return bounded(rng_next(r) >> 32, n);
+}
 
-	t = x;
-	x = y;
-	y = z;
-	z = t ^ x ^ y;
+const int RNG_BATCH = 16;
 
-	return z;
+// n 32 bit random numbers, two per step
+void rng_fill(rng_t& r, unsigned int* out, int n) {
+	int i = 0;
+	for (; i + 1 < n; i += 2) {
+		unsigned long long v = rng_next(r);
+		out[i] = v >> 32;
+		out[i + 1] = (unsigned int)v;
+	}
+	if (i < n) {
+		out[i] = rng_next(r) >> 32;
+	}
 }
 
 // Printing
@@ -198,22 +749,16 @@ void print_wholeboard_filled(board_t mini) {
 	}
 }
 
-void print_mcnode(mcnode_t* node, int depth, int cutoff) {
-	if (node->visits < cutoff)
+void print_mcnode(node_t node, int depth, int cutoff) {
+	if (VISITS[node] < cutoff)
 		return;
 
 	for (int i = 0; i < depth; i++) {
 		cerr << "  ";
 	}
-	cerr << node->mv / 9 << "-" << node->mv % 9 << " " << node->mean << "/" << node->visits << " u: " << node->upper << endl;
-	if (!node->child)
-		return;
-	mcnode_t* child = node->child;
-	while (child) {
-		//if (child->visits > 0) {
-		print_mcnode(child, depth + 1, cutoff);
-		//}
-		child = child->next;
+	cerr << MEMORY[node].mv / 9 << "-" << MEMORY[node].mv % 9 << " " << node_mean(node) << "/" << VISITS[node] << endl;
+	for (int i = 0; i < MEMORY[node].nchild; i++) {
+		print_mcnode(MEMORY[node].child + i, depth + 1, cutoff);
 	}
 }
 
@@ -240,89 +785,27 @@ miniboard_t slow_to_fast(slowminiboard_t mini) {
 	return value;
 }
 
-void fast_to_slow(miniboard_t mini, slowminiboard_t value) {
-	for (int i = 0; i < 9; i++) {
-		value[i] = mini % 3;
-		mini /= 3;
-	}
-}
-
 // Movegen
 
-int get_winner(slowminiboard_t mini) {
-	for (int i = 0; i < 3; i++) {
-		if (mini[i] != 0 && mini[i] == mini[i + 3] && mini[i] == mini[i + 6]) {
-			return mini[i];
-		}
-		if (mini[i * 3] != 0 && mini[i * 3] == mini[i * 3 + 1] && mini[i * 3] == mini[i * 3 + 2]) {
-			return mini[i * 3];
-		}
-	}
-	if (mini[4] != 0) {
-		if (mini[0] == mini[4] && mini[0] == mini[8])
-			return mini[4];
-		if (mini[2] == mini[4] && mini[2] == mini[6])
-			return mini[4];
-	}
-	for (int i = 0; i < 9; i++) {
-		if (mini[i] == 0) {
-			return NOT_OVER;
-		}
-	}
-	return EGALITY;
-}
-
-
+// Only what constexpr can not compute: the float tables and the Zobrist keys
 void init_precalculations() {
-	srand(0);
-	for (int i = 0; i < 81; i++) {
-		max_from_move[i] = i % 3 + 3 * ((i % 27) / 9);
-		min_from_move[i] = (i % 9) / 3 + 3 * (i / 27);
-		movegen_to_move[i] = max_from_move[i] + min_from_move[i] * 9;
-	}
 #ifdef USE_LOGINT
-	for (int i = 1; i < 1024; i++) {
-		firstlog1024[i] = (int)std::log2(i);
+	for (int i = 0; i < 32; i++) {
+		sqrt_from_log[i] = std::sqrt(i);
 	}
 #endif
-	for (int i = 0; i < 9; i++) {
-		for (int j = 0; j < 512; j++) {
-			RD_POS[i * 512 + j] = -1;
-		}
+	std::mt19937_64 zobrist_rng(0);
+	for (int i = 0; i < 81; i++) {
+		zobrist_from_stone[i][0] = 0;
+		zobrist_from_stone[i][1] = zobrist_rng();
+		zobrist_from_stone[i][2] = zobrist_rng();
 	}
-	for (int j = 0; j < 512; j++) {
-		int val = j;
-		int counter = 0;
-		for (int i = 0; i < 9; i++) {
-			if (val & 1) {
-				RD_POS[counter * 512 + j] = i;
-				counter++;
-			}
-			val >>= 1;
-		}
+	for (int i = 0; i < 10; i++) {
+		zobrist_from_forced[i] = zobrist_rng();
 	}
-
-	for (int i = 0; i < BOARD_POSITIONS; i++) {
-		slowminiboard_t val;
-		fast_to_slow(i, val);
-		assert(slow_to_fast(val) == i);
-		std::vector<int> moves = std::vector<int>();
-
-		// print_slowboard(val);
-
-
-
-		state_from_miniboard[i] = get_winner(val);
-		int emptybits = 0;
-		for (int j = 0; j < 9; j++) {
-			if (val[j] == 0) {
-				emptybits += 1 << j;
-				moves.push_back(j % 3 + (j / 3) * 9);
-			}
-		}
-		empty_from_miniboard[i] = moves;
-		emptybits_from_miniboard[i] = emptybits;
-		nb_emptybits_from_miniboard[i] = moves.size();
+	zobrist_player = zobrist_rng();
+	for (int i = 1; i < INVSQRT_SIZE; i++) {
+		invsqrt_from_visits[i] = 1 / std::sqrt(i);
 	}
 }
 
@@ -337,32 +820,26 @@ movelist_t moves(board_t board, move_t last_move) {
 	int maxboard = max_from_move[last_move];
 	int state = state_from_miniboard[board[maxboard]];
 	movelist_t moves;
+	moves.reserve(81);
 
 	//cerr << "maxb " << maxboard << " st "<<state<<endl;
 	//print_fastboard(board[maxboard]);
 	//print_wholeboard(board);
 
 	if (state == NOT_OVER) {
-		moves = empty_from_miniboard[board[maxboard]];
-		//cerr << "empties size "<<moves.size() << endl;
-
-		for (unsigned int i = 0; i < moves.size(); i++) {
-			moves[i] += (maxboard % 3) * 3 + (maxboard / 3) * 27;
+		const signed char* empties = empty_from_miniboard[board[maxboard]];
+		for (int i = 0; i < nb_emptybits_from_miniboard[board[maxboard]]; i++) {
+			moves.push_back(empties[i] + (maxboard % 3) * 3 + (maxboard / 3) * 27);
 		}
 	}
 	else {
-		moves = movelist_t();
 		for (int i = 0; i < 9; i++) {
 			if (state_from_miniboard[board[i]] == NOT_OVER) {
 				//cerr << "using board " << i << " ";
-				auto empties = empty_from_miniboard[board[i]];
-				//cerr << &empties << " " << &empty_from_miniboard << " ";
-				for (unsigned int j = 0; j < empties.size(); j++) {
-					empties[j] += (i % 3) * 3 + (i / 3) * 27;
-					//cerr << empties[j] << " ";
+				const signed char* empties = empty_from_miniboard[board[i]];
+				for (int j = 0; j < nb_emptybits_from_miniboard[board[i]]; j++) {
+					moves.push_back(empties[j] + (i % 3) * 3 + (i / 3) * 27);
 				}
-				//cerr << endl;
-				moves.insert(moves.end(), empties.begin(), empties.end());
 			}
 		}
 	}
@@ -474,6 +951,88 @@ void undo_move(board_t board, move_t mov, int player) {
 	board[min_from_move[mov]] -= POW_THREE[maxb] * play_id;
 }
 
+// Game state
+// The board along with the macro board summary get_status needs, kept up to date move by move
+struct game_t {
+	board_t b;
+	int macro; // Base 3 board of won miniboards, drawn ones count as empty
+	int open; // Number of miniboards still being played
+	int w_a; // Miniboards won by 1 minus miniboards won by 2
+	unsigned long long key; // Zobrist key of the stones
+};
+
+// Adds (sign = 1) or removes (sign = -1) the contribution of miniboard i in state st
+inline void update_summary(game_t& g, int i, int st, int sign) {
+	g.macro += sign * calc[st + 1] * POW_THREE[i];
+	g.open += sign * (st == NOT_OVER);
+	g.w_a += sign * (st > 0 ? -2 * st + 3 : 0);
+}
+
+void init_game(game_t& g, const board_t b) {
+	g.macro = 0;
+	g.open = 0;
+	g.w_a = 0;
+	g.key = 0;
+	for (int i = 0; i < 9; i++) {
+		g.b[i] = b[i];
+		update_summary(g, i, state_from_miniboard[b[i]], 1);
+		for (int j = 0; j < 9; j++) {
+			g.key ^= zobrist_from_stone[9 * i + j][b[i] / POW_THREE[j] % 3];
+		}
+	}
+}
+
+// Key of the position after last_move was played by player, never 0.
+// The forced miniboard is part of the position: the same stones allow other moves when it differs.
+inline unsigned long long position_key(const game_t& g, move_t last_move, int player) {
+	int forced = 9;
+	if (last_move != NULL_MOVE && state_from_miniboard[g.b[max_from_move[last_move]]] == NOT_OVER) {
+		forced = max_from_move[last_move];
+	}
+	return (g.key ^ zobrist_from_forced[forced] ^ (player == 1 ? zobrist_player : 0)) | 1;
+}
+
+// Same as get_status(board_t) in O(1)
+inline int get_status(const game_t& g) {
+	int rs = state_from_miniboard[g.macro];
+	if (rs >= 1)
+		return rs;
+	if ((rs == -1 && g.open == 0) || rs == 0) {
+		if (g.w_a > 0) {
+			return 1;
+		}
+		else if (g.w_a < 0) {
+			return 2;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+inline void apply_move(game_t& g, move_t mov, int player) {
+	int mini = min_from_move[mov];
+	int before = state_from_miniboard[g.b[mini]];
+	g.b[mini] += POW_THREE[max_from_move[mov]] * play_id_table[player + 1];
+	g.key ^= zobrist_from_stone[9 * mini + max_from_move[mov]][play_id_table[player + 1]];
+	int after = state_from_miniboard[g.b[mini]];
+	if (before != after) {
+		update_summary(g, mini, before, -1);
+		update_summary(g, mini, after, 1);
+	}
+}
+
+inline void undo_move(game_t& g, move_t mov, int player) {
+	int mini = min_from_move[mov];
+	int before = state_from_miniboard[g.b[mini]];
+	g.b[mini] -= POW_THREE[max_from_move[mov]] * play_id_table[player + 1];
+	g.key ^= zobrist_from_stone[9 * mini + max_from_move[mov]][play_id_table[player + 1]];
+	int after = state_from_miniboard[g.b[mini]];
+	if (before != after) {
+		update_summary(g, mini, before, -1);
+		update_summary(g, mini, after, 1);
+	}
+}
+
 std::clock_t start_t;
 inline int get_time() {
 	return 10000 * (std::clock() - start_t) / CLOCKS_PER_SEC;
@@ -481,127 +1040,200 @@ inline int get_time() {
 
 move_t big[81];
 move_t not_big[81];
-// TODO inline?
 
-float minsqrt = 10000;
-float maxsqrt = -10000;
-float minlog = 10000000;
-float maxlog = 0;
-int calls = 0;
+inline float inv_sqrt(int visits) {
+	return visits < INVSQRT_SIZE ? invsqrt_from_visits[visits] : 1 / std::sqrt((float)visits);
+}
 
-mcnode_t* pick_uct_node(mcnode_t* root) {
-	mcnode_t* best = root->child;
-	mcnode_t* iter = best;
+inline float sqrt_log_visits(node_t node) {
 #ifdef USE_LOGINT
-	float root_log = std::sqrt(log2_32(root->visits));
+	return sqrt_from_log[log2_32(load_relaxed(VISITS[node]))];
 #else
-	float root_log = std::sqrt(std::log2(root->visits));
+	return std::sqrt(std::log2(load_relaxed(VISITS[node])));
 #endif
+}
 
-	float upper = best->upper;
+// Tie break between unvisited children, a hash of the node index in [0, 0.01)
+inline float fpu_noise(node_t node) {
+	return ((node * 2654435761u) >> 22) * (0.01f / 1024);
+}
+
+// c_log is C * sqrt(log2(parent visits)), proven losses are never picked
+inline float node_ucb(node_t node, float c_log) {
+	if (load_relaxed(PROVEN[node]) == PROVEN_LOSS) {
+		return -INFINITY;
+	}
+	int visits = load_relaxed(VISITS[node]);
+	if (visits == 0) {
+		return FPU_C + fpu_noise(node);
+	}
+	float inv = inv_sqrt(visits);
+	return load_relaxed(SCORE[node]) * 0.5f * inv * inv + c_log * inv;
+}
 
-	while (iter->next) {
-		iter = iter->next;
-		float upper2 = iter->upper;
+// First child with the highest UCB among the n starting at first
+node_t pick_uct_scalar(node_t first, int n, float c_log) {
+	node_t best = first;
+	float upper = node_ucb(first, c_log);
+	for (node_t i = first + 1; i < first + n; i++) {
+		float upper2 = node_ucb(i, c_log);
 		if (upper2 > upper) {
 			upper = upper2;
-			best = iter;
+			best = i;
 		}
 	}
 	return best;
 }
-int nodes = 0;
-mcnode_t* expand_nodes(mcnode_t* root, board_t b) {
-	// assert(!root->child);
-	//movelist_t mvlist = moves(b, root->mv);
-	mcnode_t* child = allocate();
-	mcnode_t* random_child = 0;
 
-	unsigned long long int first_part = 0;
-	int second_part = 0;
-	int nb;
-	if (root->mv == NULL_MOVE) {
-		first_part = 0xFFFFFFFFFFFFFFFF;
-		second_part = 0xFFFFFFF;
-		nb = 81;
+// 8 children at a time, every lane keeps its own best value and index, lanes are merged at the end.
+// Statistics may be updated concurrently, 4 byte aligned stores are never torn.
+__attribute__((target("avx2")))
+node_t pick_uct_avx2(node_t first, int n, float c_log) {
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 vc_log = _mm256_set1_ps(c_log);
+	const __m256 fpu = _mm256_set1_ps(FPU_C);
+	const __m256 noise_scale = _mm256_set1_ps(0.01f / 1024);
+	const __m256 minus_inf = _mm256_set1_ps(-INFINITY);
+	const __m256i loss = _mm256_set1_epi32(PROVEN_LOSS);
+	__m256 best_v = minus_inf;
+	__m256i best_i = _mm256_set1_epi32(first);
+	__m256i index = _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	node_t i = first;
+	for (; i + 8 <= first + n; i += 8) {
+		__m256i visits = _mm256_loadu_si256((__m256i*)&VISITS[i]);
+		__m256 score = _mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i*)&SCORE[i]));
+		__m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_cvtepi32_ps(visits)));
+		__m256 ucb = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(score, half), _mm256_mul_ps(inv, inv)), _mm256_mul_ps(vc_log, inv));
+		__m256i hash = _mm256_srli_epi32(_mm256_mullo_epi32(index, _mm256_set1_epi32(2654435761u)), 22);
+		__m256 unvisited = _mm256_add_ps(fpu, _mm256_mul_ps(_mm256_cvtepi32_ps(hash), noise_scale));
+		ucb = _mm256_blendv_ps(ucb, unvisited, _mm256_castsi256_ps(_mm256_cmpeq_epi32(visits, _mm256_setzero_si256())));
+		__m256i proven = _mm256_cvtepi8_epi32(_mm_loadl_epi64((__m128i*)&PROVEN[i]));
+		ucb = _mm256_blendv_ps(ucb, minus_inf, _mm256_castsi256_ps(_mm256_cmpeq_epi32(proven, loss)));
+		__m256 gt = _mm256_cmp_ps(ucb, best_v, _CMP_GT_OQ);
+		best_v = _mm256_blendv_ps(best_v, ucb, gt);
+		best_i = _mm256_blendv_epi8(best_i, index, _mm256_castps_si256(gt));
+		index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
 	}
-	else {
-		nb = fast_moves(b, root->mv, first_part, second_part);
+	alignas(32) float lane_v[8];
+	alignas(32) node_t lane_i[8];
+	_mm256_store_ps(lane_v, best_v);
+	_mm256_store_si256((__m256i*)lane_i, best_i);
+	node_t best = first;
+	float upper = -INFINITY;
+	for (int l = 0; l < 8; l++) {
+		if (lane_v[l] > upper || (lane_v[l] == upper && lane_i[l] < best)) {
+			upper = lane_v[l];
+			best = lane_i[l];
+		}
+	}
+	for (; i < first + n; i++) {
+		float upper2 = node_ucb(i, c_log);
+		if (upper2 > upper) {
+			upper = upper2;
+			best = i;
+		}
 	}
-	int rd = rand() % nb;
-	int cnt = -1;
-	nodes += nb;
+	return best;
+}
 
-	root->child = child;
+node_t (*pick_uct)(node_t first, int n, float c_log) = pick_uct_scalar;
 
-	if (first_part > 0) {
-		for (int i = 0; i < 63; i++) {
-			if ((first_part & (1ULL << i)) > 0) {
-				cnt++;
-				move_t mv = movegen_to_move[i];
-				if (cnt == rd) {
-					random_child = child;
-				}
-				child->child = nullptr;
-				child->mv = mv;
-				child->player = -root->player; // -1 <--> 1
-				child->visits = 0;
-				child->mean = 0;
-				child->parent = root;
-				child->upper = FPU_C + ((float)(rand()) / RAND_MAX) / 100.0f;
-				if (cnt < nb - 1) {
-					child->next = allocate();
-					child = child->next;
-				}
-				else {
-					child->next = 0;
-				}
-			}
-		}
+// RAVE
+// With RAVE a child is valued by a blend of its mean and its all moves as first mean: the results of
+// the playouts through its parent in which the player of the child played its move at any later ply,
+// in the tree or in the rollout. The weight of the AMAF mean, sqrt(RAVE_K / (3 * visits + RAVE_K)),
+// decays as the child gets visits of its own. A cell is played once per game, so the stones of the
+// final position are enough to tell which moves were played. Batched leaf rollouts keep no final
+// position, RAVE is off with LEAF_ROLLOUTS > 1.
+bool rave_active = RAVE;
+thread_local bitboard_t rollout_stones[2]; // Cells of play id 1 and 2 at the end of the last playout
+
+inline void record_stones(const game_t& g) {
+	rollout_stones[0] = rollout_stones[1] = 0;
+	for (int i = 0; i < 9; i++) {
+		rollout_stones[0] |= (bitboard_t)stones_from_miniboard[g.b[i]][0] << (9 * i);
+		rollout_stones[1] |= (bitboard_t)stones_from_miniboard[g.b[i]][1] << (9 * i);
 	}
+}
 
-	for (int i = 0; i < 18; i++) {
-		if ((second_part & (1 << i)) > 0) {
-			cnt++;
-			move_t mv = movegen_to_move[63 + i];
-			if (cnt == rd) {
-				random_child = child;
-			}
-			child->child = nullptr;
-			child->mv = mv;
-			child->player = -root->player; // -1 <--> 1
-			child->visits = 0;
-			child->mean = 0;
-			child->parent = root;
-			child->upper = FPU_C + ((float)(rand()) / RAND_MAX) / 100.0f;
-			if (cnt < nb - 1) {
-				child->next = allocate();
-				child = child->next;
-			}
-			else {
-				child->next = 0;
-			}
-		}
+inline float amaf_mean(node_t node) {
+	int amaf = load_relaxed(AMAF_VISITS[node]);
+	return amaf > 0 ? load_relaxed(AMAF_SCORE[node]) * 0.5f / amaf : 0.5f;
+}
+
+inline float rave_beta(node_t node, int visits) {
+	return load_relaxed(AMAF_VISITS[node]) > 0 ? std::sqrt(RAVE_K / (3 * visits + RAVE_K)) : 0;
+}
+
+inline float rave_mean(node_t node) {
+	float mean = node_mean(node);
+	return mean + rave_beta(node, load_relaxed(VISITS[node])) * (amaf_mean(node) - mean);
+}
+
+// As node_ucb, an unvisited child has FPU_C moved by the distance of its AMAF mean to a draw
+inline float node_rave_ucb(node_t node, float c_log) {
+	if (load_relaxed(PROVEN[node]) == PROVEN_LOSS) {
+		return -INFINITY;
 	}
+	int visits = load_relaxed(VISITS[node]);
+	if (visits == 0) {
+		return FPU_C + amaf_mean(node) - 0.5f + fpu_noise(node);
+	}
+	float inv = inv_sqrt(visits);
+	float mean = load_relaxed(SCORE[node]) * 0.5f * inv * inv;
+	return mean + rave_beta(node, visits) * (amaf_mean(node) - mean) + c_log * inv;
+}
 
-	//assert(random_child);
-	return random_child;
+node_t pick_rave(node_t first, int n, float c_log) {
+	node_t best = first;
+	float upper = node_rave_ucb(first, c_log);
+	for (node_t i = first + 1; i < first + n; i++) {
+		float upper2 = node_rave_ucb(i, c_log);
+		if (upper2 > upper) {
+			upper = upper2;
+			best = i;
+		}
+	}
+	return best;
 }
 
-int chit = 0;
+// Adds val, in half points for player, to the children of parent whose move player played in the last playout
+inline void update_amaf(node_t parent, int player, int val) {
+	bitboard_t played = rollout_stones[play_id_table[player + 1] - 1];
+	node_t first = MEMORY[parent].child;
+	for (node_t c = first; c < first + load_nchild(parent); c++) {
+		if ((played >> movegen_to_move[MEMORY[c].mv]) & 1) {
+			__atomic_add_fetch(&AMAF_VISITS[c], 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&AMAF_SCORE[c], val, __ATOMIC_RELAXED);
+		}
+	}
+}
 
-move_t get_random_move(board_t board, move_t last_move, int player) {
-	unsigned long long int first_part = 0;
-	int second_part = 0;
-	int rd;
-	if (last_move == NULL_MOVE) {
-		first_part = 0xFFFFFFFFFFFFFFFF;
-		second_part = 0xFFFFFFF;
-		rd = fast_rand() % 81;
+inline node_t pick_uct_node(node_t root, int nchild) {
+	if (rave_active) {
+		return pick_rave(MEMORY[root].child, nchild, C * sqrt_log_visits(root));
 	}
-	else {
-		rd = fast_rand() % fast_moves(board, last_move, first_part, second_part);
+	return pick_uct(MEMORY[root].child, nchild, C * sqrt_log_visits(root));
+}
+
+void init_node(node_t node, move_t mv, int player) {
+	MEMORY[node].child = NULL_NODE;
+	MEMORY[node].nchild = 0;
+	MEMORY[node].mv = mv;
+	MEMORY[node].player = player;
+	MEMORY[node].expanding = 0;
+	VISITS[node] = 0;
+	SCORE[node] = 0;
+	PROVEN[node] = UNPROVEN;
+	if (RAVE) {
+		AMAF_VISITS[node] = 0;
+		AMAF_SCORE[node] = 0;
 	}
+}
+
+// Move for the rd-th set bit of the fast_moves masks
+inline move_t nth_move(unsigned long long first_part, int second_part, int rd) {
 	int cnt = 0;
 
 	for (int i = 0; i < 7; i++) {
@@ -625,128 +1257,1336 @@ move_t get_random_move(board_t board, move_t last_move, int player) {
 	return NULL_MOVE;
 }
 
-int simulate(mcnode_t* node, board_t board) {
-	move_t last_move = node->mv;
-	board_t cp;
-	for (int j = 0; j < 9; j++)
-		cp[j] = board[j];
-	int player = -node->player;
-	int status = get_status(board);
-	while (status == NOT_OVER) {
-		move_t rdmv = get_random_move(board, last_move, player);
-		apply_move(board, rdmv, player);
-		last_move = rdmv;
-		player *= -1;
-		status = get_status(board);
+// Lazy expansion
+// With LAZY_EXPANSION an expanded node gets a single child. The others are created one at a time,
+// when selection would rather try an unvisited move than the best existing child, which is when
+// full expansion would have picked an unvisited child. Until every move has its child the node is
+// flagged LAZY_PENDING and its block has room up to the next power of two, a full block moves to
+// one twice as big. Moving children is only safe with a single thread per tree, so the tree
+// parallel search and the transposition table expand fully.
+bool LAZY_EXPANSION = true;
+bool lazy_active = LAZY_EXPANSION;
+const char LAZY_PENDING = 2;
+
+// Legal moves after mv as fast_moves masks, returns their number
+inline int legal_moves(game_t& game, move_t mv, unsigned long long& first_part, int& second_part) {
+	if (mv == NULL_MOVE) {
+		first_part = 0xFFFFFFFFFFFFFFFF;
+		second_part = 0x3FFFF;
+		return 81;
+	}
+	return fast_moves(game.b, mv, first_part, second_part);
+}
+
+// Only called by the thread holding root's expanding flag, children are published once fully initialized.
+// A position already in the transposition table reuses its children instead.
+// lazy only creates the child returned. Returns NULL_NODE when the arena is full.
+node_t expand_nodes(node_t root, game_t& game, bool lazy) {
+	// assert(!root->child);
+	//movelist_t mvlist = moves(b, root->mv);
+	move_t root_mv = MEMORY[root].mv;
+	int player = -MEMORY[root].player; // -1 <--> 1
+	unsigned long long key = 0;
+	if (tt_active) {
+		key = position_key(game, root_mv, MEMORY[root].player);
+		node_t shared;
+		int nb;
+		if (tt_probe(key, shared, nb)) {
+			tt_hits.fetch_add(1, std::memory_order_relaxed);
+			MEMORY[root].child = shared;
+			__atomic_store_n(&MEMORY[root].nchild, nb, __ATOMIC_RELEASE);
+			return shared + rng_below(thread_rng, nb);
+		}
+	}
+
+	unsigned long long int first_part = 0;
+	int second_part = 0;
+	int nb = legal_moves(game, root_mv, first_part, second_part);
+	int rd = rng_below(thread_rng, nb);
+	STAT(thread_stats.branching[nb]++);
+	if (lazy && nb > 1) {
+		node_t child = allocate(1);
+		if (child == NULL_NODE) {
+			return NULL_NODE;
+		}
+		init_node(child, nth_move(first_part, second_part, rd), player);
+		MEMORY[root].expanding = LAZY_PENDING;
+		MEMORY[root].child = child;
+		__atomic_store_n(&MEMORY[root].nchild, 1, __ATOMIC_RELEASE);
+		return child;
+	}
+
+	node_t first = allocate(nb);
+	if (first == NULL_NODE) {
+		return NULL_NODE;
+	}
+	node_t child = first;
+	for (int i = 0; i < 63; i++) {
+		if ((first_part & (1ULL << i)) > 0) {
+			init_node(child, movegen_to_move[i], player);
+			child++;
+		}
+	}
+	for (int i = 0; i < 18; i++) {
+		if ((second_part & (1 << i)) > 0) {
+			init_node(child, movegen_to_move[63 + i], player);
+			child++;
+		}
+	}
+
+	if (tt_active) {
+		tt_store(key, first, nb);
+	}
+	MEMORY[root].child = first;
+	__atomic_store_n(&MEMORY[root].nchild, nb, __ATOMIC_RELEASE);
+	return first + rd;
+}
+
+// Creates the child of a LAZY_PENDING node for one of its moves left, picked at random.
+// Returns NULL_NODE when the arena is full.
+node_t widen_node(node_t node, game_t& game) {
+	mcnode_t& n = MEMORY[node];
+	unsigned long long int first_part = 0;
+	int second_part = 0;
+	int nb = legal_moves(game, n.mv, first_part, second_part);
+	for (node_t c = n.child; c < n.child + n.nchild; c++) {
+		int bit = movegen_to_move[MEMORY[c].mv];
+		if (bit < 63) {
+			first_part &= ~(1ULL << bit);
+		}
+		else {
+			second_part &= ~(1 << (bit - 63));
+		}
+	}
+	move_t mv = nth_move(first_part, second_part, rng_below(thread_rng, nb - n.nchild));
+	if ((n.nchild & (n.nchild - 1)) == 0) { // The block is full
+		node_t block = allocate(std::min(2 * n.nchild, nb));
+		if (block == NULL_NODE) {
+			return NULL_NODE;
+		}
+		std::copy(MEMORY + n.child, MEMORY + n.child + n.nchild, MEMORY + block);
+		std::copy(VISITS + n.child, VISITS + n.child + n.nchild, VISITS + block);
+		std::copy(SCORE + n.child, SCORE + n.child + n.nchild, SCORE + block);
+		std::copy(PROVEN + n.child, PROVEN + n.child + n.nchild, PROVEN + block);
+		if (RAVE) {
+			std::copy(AMAF_VISITS + n.child, AMAF_VISITS + n.child + n.nchild, AMAF_VISITS + block);
+			std::copy(AMAF_SCORE + n.child, AMAF_SCORE + n.child + n.nchild, AMAF_SCORE + block);
+		}
+		if (recycle_active) {
+			free_block(n.child, n.nchild);
+		}
+		n.child = block;
+	}
+	node_t child = n.child + n.nchild;
+	init_node(child, mv, -n.player);
+	n.nchild++;
+	if (n.nchild == nb) {
+		n.expanding = 1;
+	}
+	return child;
+}
+
+move_t get_random_move(board_t board, move_t last_move, int player) {
+	unsigned long long int first_part = 0;
+	int second_part = 0;
+	int rd;
+	if (last_move == NULL_MOVE) {
+		first_part = 0xFFFFFFFFFFFFFFFF;
+		second_part = 0xFFFFFFF;
+		rd = rng_below(thread_rng, 81);
+	}
+	else {
+		rd = rng_below(thread_rng, fast_moves(board, last_move, first_part, second_part));
+	}
+	return nth_move(first_part, second_part, rd);
+}
+
+// Tactical rollouts
+// A rollout sent to an open miniboard takes a cell winning it, else one the opponent would win it with.
+// Moves to any miniboard stay uniform.
+bool TACTICAL_ROLLOUTS = true;
+
+// Cells of miniboard m to pick from for play id id + 1, 0 to pick uniformly
+inline int tactical_cells(miniboard_t m, int id) {
+	int cells = wins_from_miniboard[m][id];
+	return cells ? cells : wins_from_miniboard[m][id ^ 1];
+}
+
+// player is the one to move
+int simulate_tables(const game_t& start, move_t last_move, int player) {
+	game_t game = start;
+	int status = get_status(game);
+	const bool tactical = TACTICAL_ROLLOUTS;
+	while (status == NOT_OVER) {
+		int cells = tactical && last_move != NULL_MOVE ? tactical_cells(game.b[max_from_move[last_move]], play_id_table[player + 1] - 1) : 0;
+		move_t rdmv = cells ? movegen_to_move[9 * max_from_move[last_move] + RD_POS[rng_below(thread_rng, POPCNT[cells]) * 512 + cells]] : get_random_move(game.b, last_move, player);
+		apply_move(game, rdmv, player);
+		STAT(thread_stats.plies++);
+		last_move = rdmv;
+		player *= -1;
+		status = get_status(game);
+	}
+	if (rave_active) {
+		record_stones(game);
+	}
+	return status;
+}
+
+// Bitboard rollouts
+// Positions as 81 bit masks, bit 9 * miniboard + cell, the same indexing as movegen_to_move.
+// Needs BMI2 for the k-th set bit lookup, simulate_tables is the fallback.
+
+struct bitpos_t {
+	bitboard_t stones[2]; // Cells of play id 1 and 2
+	bitboard_t avail; // Empty cells of open miniboards
+	int won[2]; // Miniboards won by play id 1 and 2, 9 bit masks
+};
+
+inline bitboard_t mini_mask(int mini) {
+	return (bitboard_t)0x1FF << (9 * mini);
+}
+
+void init_bitpos(bitpos_t& p, const game_t& g) {
+	p.stones[0] = p.stones[1] = p.avail = 0;
+	p.won[0] = p.won[1] = 0;
+	for (int i = 0; i < 9; i++) {
+		p.stones[0] |= (bitboard_t)stones_from_miniboard[g.b[i]][0] << (9 * i);
+		p.stones[1] |= (bitboard_t)stones_from_miniboard[g.b[i]][1] << (9 * i);
+		int st = state_from_miniboard[g.b[i]];
+		if (st == NOT_OVER) {
+			p.avail |= (bitboard_t)emptybits_from_miniboard[g.b[i]] << (9 * i);
+		}
+		else if (st > 0) {
+			p.won[st - 1] |= 1 << i;
+		}
+	}
+}
+
+// Legal moves when the last move was played on cell next (9 after a null move)
+inline bitboard_t moves_bitboard(const bitpos_t& p, int next) {
+	bitboard_t moves = next < 9 ? p.avail & mini_mask(next) : 0;
+	return moves ? moves : p.avail;
+}
+
+// Index of the k-th set bit of moves
+__attribute__((target("bmi,bmi2,popcnt")))
+inline int nth_bit(bitboard_t moves, int k) {
+	unsigned long long lo = (unsigned long long)moves;
+	unsigned long long hi = (unsigned long long)(moves >> 64);
+	int nb_lo = _mm_popcnt_u64(lo);
+	if (k < nb_lo) {
+		return _tzcnt_u64(_pdep_u64(1ULL << k, lo));
+	}
+	return 64 + _tzcnt_u64(_pdep_u64(1ULL << (k - nb_lo), hi));
+}
+
+// Index of the set bit of moves picked by the 32 bit random number rd
+__attribute__((target("bmi,bmi2,popcnt")))
+inline int get_random_move_bitboard(bitboard_t moves, unsigned int rd) {
+	int nb = _mm_popcnt_u64((unsigned long long)moves) + _mm_popcnt_u64((unsigned long long)(moves >> 64));
+	return nth_bit(moves, bounded(rd, nb));
+}
+
+// Plays bit for play id id + 1, returns the game status
+__attribute__((target("bmi,bmi2,popcnt")))
+inline int apply_move_bitboard(bitpos_t& p, int bit, int id) {
+	int mini = bit / 9;
+	p.stones[id] |= (bitboard_t)1 << bit;
+	p.avail &= ~((bitboard_t)1 << bit);
+	if (line_from_bits[(int)(p.stones[id] >> (9 * mini)) & 0x1FF]) {
+		p.won[id] |= 1 << mini;
+		if (line_from_bits[p.won[id]])
+			return id + 1;
+		p.avail &= ~mini_mask(mini);
+	}
+	if (!p.avail) { // No open miniboard left
+		int w_a = _mm_popcnt_u32(p.won[0]) - _mm_popcnt_u32(p.won[1]);
+		return w_a > 0 ? 1 : (w_a < 0 ? 2 : 0);
+	}
+	return NOT_OVER;
+}
+
+__attribute__((target("bmi,bmi2,popcnt")))
+int simulate_bitboard(const game_t& start, move_t last_move, int player) {
+	int status = get_status(start);
+	if (status != NOT_OVER)
+		return status;
+	bitpos_t p;
+	init_bitpos(p, start);
+	int next = last_move == NULL_MOVE ? 9 : max_from_move[last_move];
+	int id = play_id_table[player + 1] - 1;
+	const bool tactical = TACTICAL_ROLLOUTS;
+	// Random numbers are drawn RNG_BATCH at a time from a local copy of the thread rng
+	rng_t rng = thread_rng;
+	unsigned int rds[RNG_BATCH];
+	int left = 0;
+	while (true) {
+		if (!left) {
+			rng_fill(rng, rds, RNG_BATCH);
+			left = RNG_BATCH;
+		}
+		bitboard_t moves = moves_bitboard(p, next);
+		if (tactical && next < 9) {
+			int open = (int)(p.avail >> (9 * next)) & 0x1FF; // 0 once closed
+			int cells = threat_from_bits[(int)(p.stones[id] >> (9 * next)) & 0x1FF] & open;
+			if (!cells) {
+				cells = threat_from_bits[(int)(p.stones[id ^ 1] >> (9 * next)) & 0x1FF] & open;
+			}
+			if (cells) {
+				moves = (bitboard_t)cells << (9 * next);
+			}
+		}
+		int bit = get_random_move_bitboard(moves, rds[--left]);
+		int status = apply_move_bitboard(p, bit, id);
+		STAT(thread_stats.plies++);
+		if (status != NOT_OVER) {
+			thread_rng = rng;
+			if (rave_active) {
+				rollout_stones[0] = p.stones[0];
+				rollout_stones[1] = p.stones[1];
+			}
+			return status;
+		}
+		next = bit % 9;
+		id ^= 1;
+	}
+}
+
+int (*simulate)(const game_t& start, move_t last_move, int player) = simulate_tables;
+
+// Batched rollouts
+// SIMD_LANES random games are played from the same position, results are statuses as returned by get_status.
+const int SIMD_LANES = 8;
+
+void simulate_batch_scalar(const game_t& game, move_t last_move, int player, int* results) {
+	for (int i = 0; i < SIMD_LANES; i++) {
+		results[i] = simulate(game, last_move, player);
+	}
+}
+
+// Every lane plays its own game in lockstep with the others, finished lanes are masked out.
+// Miniboards are stored lane-interleaved so that the one to play in can be gathered.
+// Tactical rollouts narrow a forced lane to the cells of tactical_cells.
+__attribute__((target("avx2")))
+void simulate_batch_avx2(const game_t& game, move_t last_move, int player, int* results) {
+	const int* board = game.b;
+	int status = get_status(game);
+	if (status != NOT_OVER) {
+		for (int i = 0; i < SIMD_LANES; i++)
+			results[i] = status;
+		return;
+	}
+	// A 10th miniboard, won by player 1, stands for "play anywhere" after a null move
+	alignas(32) int mb[10 * SIMD_LANES];
+	__m256i st[9];
+	for (int i = 0; i < 9; i++) {
+		_mm256_store_si256((__m256i*)&mb[i * SIMD_LANES], _mm256_set1_epi32(board[i]));
+		st[i] = _mm256_set1_epi32(state_from_miniboard[board[i]]);
+	}
+	_mm256_store_si256((__m256i*)&mb[9 * SIMD_LANES], _mm256_set1_epi32(BOARD_POSITIONS / 2));
+
+	const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i not_over = _mm256_set1_epi32(NOT_OVER);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i two = _mm256_set1_epi32(2);
+	const int* emptybits = (const int*)emptybits_from_miniboard; // low half of every 64 bit entry
+	const int* wins = (const int*)wins_from_miniboard;
+	const bool tactical = TACTICAL_ROLLOUTS;
+	__m256i next = _mm256_set1_epi32(last_move == NULL_MOVE ? 9 : max_from_move[last_move]);
+	__m256i play_id = _mm256_set1_epi32(play_id_table[player + 1]);
+	alignas(32) unsigned int seeds[SIMD_LANES];
+	rng_fill(thread_rng, seeds, SIMD_LANES);
+	__m256i rng = _mm256_or_si256(_mm256_load_si256((__m256i*)seeds), _mm256_set1_epi32(1)); // xorshift32 needs a non zero state
+	__m256i statuses = not_over;
+	__m256i active = _mm256_cmpeq_epi32(zero, zero);
+	__m256i macro = _mm256_set1_epi32(game.macro);
+	__m256i open = _mm256_set1_epi32(game.open);
+	__m256i w_a = _mm256_set1_epi32(game.w_a);
+
+	while (!_mm256_testz_si256(active, active)) {
+		// Movegen: empty cells of the target miniboard, or of every open one when it is closed
+		__m256i target = _mm256_i32gather_epi32(mb, _mm256_add_epi32(_mm256_slli_epi32(next, 3), lane), 4);
+		__m256i forced = _mm256_cmpeq_epi32(_mm256_i32gather_epi32(state_from_miniboard, target, 4), not_over);
+		// Winning cells are only set for open miniboards, the 10th one has none
+		__m256i tactic = zero;
+		__m256i narrow = zero;
+		if (tactical) {
+			__m256i index = _mm256_add_epi32(_mm256_slli_epi32(target, 1), _mm256_sub_epi32(play_id, one));
+			tactic = _mm256_i32gather_epi32(wins, index, 4);
+			tactic = _mm256_blendv_epi8(tactic, _mm256_i32gather_epi32(wins, _mm256_xor_si256(index, one), 4), _mm256_cmpeq_epi32(tactic, zero));
+			narrow = _mm256_andnot_si256(_mm256_cmpeq_epi32(tactic, zero), forced);
+		}
+		__m256i bits[9], cnt[9];
+		__m256i total = zero;
+		for (int i = 0; i < 9; i++) {
+			__m256i mini = _mm256_load_si256((__m256i*)&mb[i * SIMD_LANES]);
+			__m256i allowed = _mm256_andnot_si256(forced, _mm256_cmpeq_epi32(st[i], not_over));
+			allowed = _mm256_or_si256(allowed, _mm256_and_si256(forced, _mm256_cmpeq_epi32(next, _mm256_set1_epi32(i))));
+			bits[i] = _mm256_and_si256(allowed, _mm256_i32gather_epi32(emptybits, mini, 8));
+			cnt[i] = _mm256_and_si256(allowed, _mm256_i32gather_epi32(nb_emptybits_from_miniboard, mini, 4));
+			if (tactical) {
+				__m256i sel = _mm256_and_si256(allowed, narrow);
+				bits[i] = _mm256_blendv_epi8(bits[i], tactic, sel);
+				cnt[i] = _mm256_blendv_epi8(cnt[i], _mm256_mask_i32gather_epi32(zero, POPCNT, tactic, sel, 4), sel);
+			}
+			total = _mm256_add_epi32(total, cnt[i]);
+		}
+
+		// Per lane xorshift32, scaled to [0, total) with a multiply-shift
+		rng = _mm256_xor_si256(rng, _mm256_slli_epi32(rng, 13));
+		rng = _mm256_xor_si256(rng, _mm256_srli_epi32(rng, 17));
+		rng = _mm256_xor_si256(rng, _mm256_slli_epi32(rng, 5));
+		__m256i rd = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(rng, 16), total), 16);
+
+		// Pick the rd-th available cell
+		__m256i pos = zero;
+		__m256i chosen = not_over;
+		__m256i found = zero;
+		for (int i = 0; i < 9; i++) {
+			__m256i hit = _mm256_andnot_si256(found, _mm256_cmpgt_epi32(cnt[i], rd));
+			__m256i index = _mm256_add_epi32(_mm256_slli_epi32(rd, 9), bits[i]);
+			pos = _mm256_mask_i32gather_epi32(pos, RD_POS, index, hit, 4);
+			chosen = _mm256_blendv_epi8(chosen, _mm256_set1_epi32(i), hit);
+			found = _mm256_or_si256(found, hit);
+			rd = _mm256_sub_epi32(rd, _mm256_andnot_si256(found, cnt[i]));
+		}
+
+		// Apply the move on active lanes, a miniboard played in can only go from open to closed
+		STAT(thread_stats.plies += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_castsi256_ps(active))));
+		__m256i delta = _mm256_and_si256(active, _mm256_mullo_epi32(_mm256_i32gather_epi32(POW_THREE, pos, 4), play_id));
+		for (int i = 0; i < 9; i++) {
+			__m256i sel = _mm256_and_si256(active, _mm256_cmpeq_epi32(chosen, _mm256_set1_epi32(i)));
+			if (_mm256_testz_si256(sel, sel))
+				continue;
+			__m256i mini = _mm256_add_epi32(_mm256_load_si256((__m256i*)&mb[i * SIMD_LANES]), _mm256_and_si256(sel, delta));
+			_mm256_store_si256((__m256i*)&mb[i * SIMD_LANES], mini);
+			__m256i after = _mm256_i32gather_epi32(state_from_miniboard, mini, 4);
+			__m256i closed = _mm256_andnot_si256(_mm256_cmpeq_epi32(after, not_over), sel);
+			st[i] = _mm256_blendv_epi8(st[i], after, sel);
+			// Same as update_summary
+			macro = _mm256_add_epi32(macro, _mm256_and_si256(closed, _mm256_mullo_epi32(_mm256_max_epi32(after, zero), _mm256_set1_epi32(POW_THREE[i]))));
+			open = _mm256_add_epi32(open, closed);
+			w_a = _mm256_add_epi32(w_a, _mm256_and_si256(closed, _mm256_sub_epi32(_mm256_cmpeq_epi32(after, two), _mm256_cmpeq_epi32(after, one))));
+		}
+
+		// get_status(game_t) on every lane
+		__m256i rs = _mm256_i32gather_epi32(state_from_miniboard, macro, 4);
+		__m256i tie_break = _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi32(w_a, zero), one), _mm256_and_si256(_mm256_cmpgt_epi32(zero, w_a), two));
+		__m256i by_count = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi32(open, zero), _mm256_cmpeq_epi32(rs, not_over)), _mm256_cmpeq_epi32(rs, zero));
+		__m256i lane_status = _mm256_blendv_epi8(not_over, tie_break, by_count);
+		lane_status = _mm256_blendv_epi8(lane_status, rs, _mm256_cmpgt_epi32(rs, zero));
+		statuses = _mm256_blendv_epi8(statuses, lane_status, active);
+		active = _mm256_and_si256(active, _mm256_cmpeq_epi32(statuses, not_over));
+
+		next = pos;
+		play_id = _mm256_sub_epi32(_mm256_set1_epi32(3), play_id);
+	}
+	_mm256_storeu_si256((__m256i*)results, statuses);
+}
+
+void (*simulate_batch)(const game_t& game, move_t last_move, int player, int* results) = simulate_batch_scalar;
+
+// Leaf parallelism: with LEAF_ROLLOUTS = SIMD_LANES every expanded leaf is evaluated by a whole batch
+int LEAF_ROLLOUTS = 1;
+
+// Picks the implementations the CPU supports
+void init_cpu_dispatch() {
+	if (__builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt")) {
+		simulate = simulate_bitboard;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		simulate_batch = simulate_batch_avx2;
+		pick_uct = pick_uct_avx2;
+	}
+}
+
+// Half points scored by player for a given game status
+inline int score_for(int status, int player) {
+	if (status == (3 + player) / 2) {
+		return 2;
+	}
+	return status == EGALITY ? 1 : 0;
+}
+
+// Endgame solver
+// Alpha-beta over the exact game value in half points for the player to move (0 lost, 1 drawn, 2 won).
+// It runs under a node budget and an optional deadline, an aborted search returns -1.
+// Its table holds exact bounds of absolute positions, so it is never cleared. Entries are written
+// without locks, check = key ^ data detects entries torn by concurrent writers.
+struct solver_entry_t {
+	unsigned long long check;
+	unsigned long long data; // value | bound << 2 | (best move + 1) << 4
+};
+const int SOLVER_EXACT = 0;
+const int SOLVER_LOWER = 1;
+const int SOLVER_UPPER = 2;
+const int SOLVER_TT_BITS = 18;
+solver_entry_t SOLVER_TT[1 << SOLVER_TT_BITS];
+int ENDGAME_EMPTY = 14; // Leaves with at most this many playable cells are solved instead of simulated
+int ENDGAME_NODES = 1000; // Node budget for a leaf
+int ENDGAME_ROOT_EMPTY = 24; // The root is solved first below this many playable cells
+TimePoint ENDGAME_ROOT_MS = 20; // Time budget for the root
+thread_local int solver_nodes;
+thread_local int solver_budget;
+thread_local TimePoint solver_deadline;
+thread_local bool solver_aborted;
+
+// Cells the remaining moves can be played on
+inline int empty_cells(const game_t& g) {
+	int n = 0;
+	for (int i = 0; i < 9; i++) {
+		if (state_from_miniboard[g.b[i]] == NOT_OVER) {
+			n += nb_emptybits_from_miniboard[g.b[i]];
+		}
+	}
+	return n;
+}
+
+void solver_clear() {
+	std::fill(SOLVER_TT, SOLVER_TT + (1 << SOLVER_TT_BITS), solver_entry_t{ 0, 0 });
+}
+
+inline bool solver_probe(unsigned long long key, int& value, int& bound, move_t& mv) {
+	solver_entry_t& e = SOLVER_TT[key >> (64 - SOLVER_TT_BITS)];
+	unsigned long long data = __atomic_load_n(&e.data, __ATOMIC_RELAXED);
+	if ((__atomic_load_n(&e.check, __ATOMIC_RELAXED) ^ data) != key) {
+		return false;
+	}
+	value = data & 3;
+	bound = (data >> 2) & 3;
+	mv = (int)(data >> 4) - 1;
+	return true;
+}
+
+inline void solver_store(unsigned long long key, int value, int bound, move_t mv) {
+	solver_entry_t& e = SOLVER_TT[key >> (64 - SOLVER_TT_BITS)];
+	unsigned long long data = value | bound << 2 | (unsigned long long)(mv + 1) << 4;
+	__atomic_store_n(&e.check, key ^ data, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.data, data, __ATOMIC_RELAXED);
+}
+
+// Moves that win a miniboard are tried first, after the move stored in the table
+int endgame_search(game_t& g, move_t last_move, int player, int alpha, int beta, move_t* best_out) {
+	int status = get_status(g);
+	if (status != NOT_OVER) {
+		return score_for(status, player);
+	}
+	if (++solver_nodes > solver_budget || ((solver_nodes & 1023) == 0 && solver_deadline && now() > solver_deadline)) {
+		solver_aborted = true;
+		return 0;
+	}
+	unsigned long long key = position_key(g, last_move, -player);
+	int value, bound;
+	move_t tt_move = NULL_MOVE;
+	if (solver_probe(key, value, bound, tt_move)) {
+		if (bound == SOLVER_EXACT || (bound == SOLVER_LOWER && value >= beta) || (bound == SOLVER_UPPER && value <= alpha)) {
+			if (best_out) {
+				*best_out = tt_move;
+			}
+			return value;
+		}
+	}
+
+	unsigned long long first_part = 0;
+	int second_part = 0;
+	if (last_move == NULL_MOVE) {
+		first_part = 0xFFFFFFFFFFFFFFFF;
+		second_part = 0x3FFFF;
+	}
+	else {
+		fast_moves(g.b, last_move, first_part, second_part);
+	}
+	move_t list[81];
+	int nb = 0;
+	int nb_first = 0;
+	int play_id = play_id_table[player + 1];
+	while (first_part || second_part) {
+		int i;
+		if (first_part) {
+			i = __builtin_ctzll(first_part);
+			first_part &= first_part - 1;
+		}
+		else {
+			i = 63 + __builtin_ctz(second_part);
+			second_part &= second_part - 1;
+		}
+		move_t mv = movegen_to_move[i];
+		int mini = min_from_move[mv];
+		if (mv == tt_move) {
+			list[nb++] = list[nb_first];
+			list[nb_first] = list[0];
+			list[0] = mv;
+			nb_first++;
+		}
+		else if (state_from_miniboard[g.b[mini] + POW_THREE[max_from_move[mv]] * play_id] == play_id) {
+			list[nb++] = list[nb_first];
+			list[nb_first++] = mv;
+		}
+		else {
+			list[nb++] = mv;
+		}
+	}
+
+	int alpha0 = alpha;
+	int best = -1;
+	move_t best_move = NULL_MOVE;
+	for (int i = 0; i < nb; i++) {
+		apply_move(g, list[i], player);
+		int v = 2 - endgame_search(g, list[i], -player, 2 - beta, 2 - alpha, nullptr);
+		undo_move(g, list[i], player);
+		if (solver_aborted) {
+			return 0;
+		}
+		if (v > best) {
+			best = v;
+			best_move = list[i];
+			if (best > alpha) {
+				alpha = best;
+				if (alpha >= beta) {
+					break;
+				}
+			}
+		}
+	}
+	solver_store(key, best, best <= alpha0 ? SOLVER_UPPER : best >= beta ? SOLVER_LOWER : SOLVER_EXACT, best_move);
+	if (best_out) {
+		*best_out = best_move;
+	}
+	return best;
+}
+
+// Value for player to move after last_move, -1 if the budget ran out. deadline = 0 for none.
+int solve_endgame(game_t& g, move_t last_move, int player, int max_nodes, TimePoint deadline, move_t& best) {
+	solver_nodes = 0;
+	solver_budget = max_nodes;
+	solver_deadline = deadline;
+	solver_aborted = false;
+	best = NULL_MOVE;
+	int value = endgame_search(g, last_move, player, 0, 2, &best);
+	return solver_aborted ? -1 : value;
+}
+
+// Adds a visit without score: a virtual loss until the playout result is backed up.
+// It steers other threads away from the path this one is exploring.
+inline void add_virtual_loss(node_t node) {
+	__atomic_add_fetch(&VISITS[node], 1, __ATOMIC_RELAXED);
+}
+
+// Off while searching a lost root, every move would be proven lost the same
+bool proofs_active = true;
+
+// Proves node from its children, returns whether it is proven.
+// One child won by the player to move loses node, node is won once every child is lost.
+bool try_prove(node_t node) {
+	if (load_relaxed(PROVEN[node])) {
+		return true;
+	}
+	int nchild = load_nchild(node);
+	if (!nchild) {
+		return false;
+	}
+	node_t first = MEMORY[node].child;
+	int best = PROVEN_LOSS;
+	for (node_t i = first; i < first + nchild; i++) {
+		int proven = load_relaxed(PROVEN[i]);
+		if (proven == PROVEN_WIN) {
+			store_relaxed(PROVEN[node], PROVEN_LOSS);
+			return true;
+		}
+		best = proven == UNPROVEN || best == UNPROVEN ? UNPROVEN : std::max(best, proven);
+	}
+	if (best == UNPROVEN || MEMORY[node].expanding == LAZY_PENDING) { // Moves without a child are not proven
+		return false;
+	}
+	store_relaxed(PROVEN[node], (signed char)(PROVEN_WIN + PROVEN_LOSS - best));
+	return true;
+}
+
+// Backpropagation only touches the nodes on the path, UCB values are computed during selection.
+// Selection stops at proven nodes, their value is backed up without a rollout.
+void do_playout(node_t root, game_t& game) {
+	STAT(unsigned long long t = __rdtsc());
+	// 1. Selection
+	node_t path[MAX_DEPTH];
+	int depth = 0;
+	node_t node = root;
+	path[0] = root;
+	__atomic_add_fetch(&VISITS[root], 1, __ATOMIC_RELAXED);
+	while (true) {
+		int nchild = load_nchild(node);
+		if (!nchild || load_relaxed(PROVEN[node])) { // is leaf or solved
+			break;
+		}
+		node_t next = pick_uct_node(node, nchild);
+		float c_log = C * sqrt_log_visits(node);
+		if (MEMORY[node].expanding == LAZY_PENDING && lazy_active && (rave_active ? node_rave_ucb(next, c_log) : node_ucb(next, c_log)) < FPU_C) {
+			node_t created = widen_node(node, game);
+			next = created == NULL_NODE ? next : created;
+		}
+		node = next;
+		add_virtual_loss(node);
+		apply_move(game, MEMORY[node].mv, MEMORY[node].player);
+		path[++depth] = node;
+	}
+	STAT(thread_stats.depth[depth]++);
+	STAT(stat_lap(t, PHASE_SELECT));
+
+	// 2. Expand
+	int status = get_status(game);
+	int proven = load_relaxed(PROVEN[node]);
+	int val;
+	int rollouts = 1; // Number of results backed up by this playout
+	// Another thread is already expanding this leaf: simulate from it instead of waiting
+	if (!proven && status == NOT_OVER && __atomic_exchange_n(&MEMORY[node].expanding, 1, __ATOMIC_ACQUIRE) == 0) {
+		node_t child = expand_nodes(node, game, lazy_active && depth > 0); // The root compares all its moves
+		if (child == NULL_NODE) { // The arena is full: the leaf stays one and gets a rollout
+			__atomic_store_n(&MEMORY[node].expanding, 0, __ATOMIC_RELEASE);
+		}
+		else {
+			node = child;
+			add_virtual_loss(node);
+			apply_move(game, MEMORY[node].mv, MEMORY[node].player);
+			path[++depth] = node;
+			status = get_status(game);
+			proven = load_relaxed(PROVEN[node]);
+			STAT(stat_lap(t, PHASE_EXPAND));
+			if (!proven && status == NOT_OVER && proofs_active && empty_cells(game) <= ENDGAME_EMPTY) {
+				move_t best;
+				int value = solve_endgame(game, MEMORY[node].mv, -MEMORY[node].player, ENDGAME_NODES, 0, best);
+				if (value >= 0) {
+					proven = PROVEN_WIN - value;
+					store_relaxed(PROVEN[node], (signed char)proven);
+				}
+				STAT(stat_lap(t, PHASE_SOLVER));
+			}
+		}
+	}
+	if (proven) {
+		val = proven - 1;
+		if (rave_active) {
+			record_stones(game);
+		}
+	}
+	else if (status != NOT_OVER) {
+		val = score_for(status, MEMORY[node].player);
+		proven = val + 1;
+		store_relaxed(PROVEN[node], (signed char)proven);
+		if (rave_active) {
+			record_stones(game);
+		}
+	}
+	else {
+		// 3. Simulation
+		STAT(long long plies = thread_stats.plies);
+		move_t mv = MEMORY[node].mv;
+		int player = MEMORY[node].player;
+		if (LEAF_ROLLOUTS > 1) {
+			int results[SIMD_LANES];
+			simulate_batch(game, mv, -player, results);
+			val = 0;
+			for (int i = 0; i < SIMD_LANES; i++) {
+				val += score_for(results[i], player);
+			}
+			rollouts = SIMD_LANES;
+		}
+		else {
+			val = score_for(simulate(game, mv, -player), player); // TODO: Either win or lose ? Should be expected score maybe ? win draw lose..
+		}
+		STAT(thread_stats.rollout[std::min(81LL, (thread_stats.plies - plies) / rollouts)]++);
+		STAT(stat_lap(t, PHASE_ROLLOUT));
+	}
+
+	// 4. Backpropagation
+	// The virtual loss already counted one visit per node, a new proof is passed up as long as it proves the parent
+	bool solved = proofs_active && proven != UNPROVEN;
+	for (; depth > 0; depth--) {
+		node = path[depth];
+		mcnode_t& n = MEMORY[node];
+		undo_move(game, n.mv, n.player);
+		if (rollouts > 1) {
+			__atomic_add_fetch(&VISITS[node], rollouts - 1, __ATOMIC_RELAXED);
+		}
+		__atomic_add_fetch(&SCORE[node], val, __ATOMIC_RELAXED);
+		if (rave_active) {
+			update_amaf(path[depth - 1], n.player, val);
+		}
+		val = 2 * rollouts - val;
+		if (solved) {
+			solved = try_prove(path[depth - 1]);
+		}
+	}
+	if (rollouts > 1) {
+		__atomic_add_fetch(&VISITS[root], rollouts - 1, __ATOMIC_RELAXED);
+	}
+	STAT(stat_lap(t, PHASE_BACKPROP));
+}
+
+// Mean score, proven children are ranked by their value: a win first, a loss last
+inline float decision_value(node_t node) {
+	switch (PROVEN[node]) {
+	case PROVEN_WIN:
+		return 2;
+	case PROVEN_DRAW:
+		return 0.5f;
+	case PROVEN_LOSS:
+		return -1;
+	}
+	return rave_active ? rave_mean(node) : node_mean(node);
+}
+
+// NULL_MOVE for a root without children
+move_t pick_best_move(node_t root) {
+	if (!MEMORY[root].nchild) {
+		return NULL_MOVE;
+	}
+	float most_visits = -1;
+	node_t first = MEMORY[root].child;
+	node_t best = first;
+#ifndef AT_HOME
+	float c_log = C * sqrt_log_visits(root);
+#endif
+	for (node_t child = first; child < first + MEMORY[root].nchild; child++) {
+#ifndef AT_HOME
+		cerr << MEMORY[child].mv / 9 << "-" << MEMORY[child].mv % 9 << " v: " << VISITS[child] << " w: " << node_mean(child) << " upper: " << node_ucb(child, c_log) << " proven: " << (int)PROVEN[child] << endl;
+#endif	
+		if (decision_value(child) > most_visits) {
+			most_visits = decision_value(child);
+			best = child;
+		}
+	}
+	return MEMORY[best].mv;
+}
+
+// Tree reuse
+// The search tree survives between turns: play_CG reports every move played
+// through advance_tree, and get_best_move continues from the matching subtree.
+node_t tree_root = NULL_NODE;
+int reused_visits = 0;
+
+void reset_tree() {
+	tree_root = NULL_NODE;
+}
+
+// Moves the root down to the child for mv, or drops the tree if it was never expanded
+void advance_tree(move_t mv) {
+	if (tree_root == NULL_NODE)
+		return;
+	node_t first = MEMORY[tree_root].child;
+	node_t found = NULL_NODE;
+	for (node_t child = first; child < first + MEMORY[tree_root].nchild; child++) {
+		if (MEMORY[child].mv == mv) {
+			found = child;
+		}
+	}
+	tree_root = found;
+}
+
+// Copies the subtree under tree_root to the start of MEMORY in breadth first order,
+// everything else in the arena is dropped.
+// Blocks shared through the transposition table are copied once: the first node of a copied
+// block is marked FORWARDED and its child field holds the new block.
+const signed char FORWARDED = -2;
+void compact_tree() {
+	std::vector<mcnode_t> copy;
+	std::vector<int> visits;
+	std::vector<int> score;
+	std::vector<signed char> proven;
+	std::vector<int> amaf_visits;
+	std::vector<int> amaf_score;
+	copy.push_back(MEMORY[tree_root]);
+	visits.push_back(VISITS[tree_root]);
+	score.push_back(SCORE[tree_root]);
+	proven.push_back(PROVEN[tree_root]);
+	if (RAVE) {
+		amaf_visits.push_back(AMAF_VISITS[tree_root]);
+		amaf_score.push_back(AMAF_SCORE[tree_root]);
+	}
+	for (size_t i = 0; i < copy.size(); i++) {
+		int nchild = copy[i].nchild;
+		node_t first = copy[i].child;
+		if (!nchild) {
+			continue;
+		}
+		if (MEMORY[first].mv == FORWARDED) {
+			copy[i].child = MEMORY[first].child;
+			continue;
+		}
+		copy[i].child = copy.size();
+		for (int c = 0; c < nchild; c++) {
+			copy.push_back(MEMORY[first + c]);
+			visits.push_back(VISITS[first + c]);
+			score.push_back(SCORE[first + c]);
+			proven.push_back(PROVEN[first + c]);
+			if (RAVE) {
+				amaf_visits.push_back(AMAF_VISITS[first + c]);
+				amaf_score.push_back(AMAF_SCORE[first + c]);
+			}
+		}
+		// Room for the block to grow, as widen_node expects
+		for (int c = nchild; copy[i].expanding == LAZY_PENDING && (c & (c - 1)); c++) {
+			copy.push_back(mcnode_t());
+			visits.push_back(0);
+			score.push_back(0);
+			proven.push_back(UNPROVEN);
+			if (RAVE) {
+				amaf_visits.push_back(0);
+				amaf_score.push_back(0);
+			}
+		}
+		MEMORY[first].mv = FORWARDED;
+		MEMORY[first].child = copy[i].child;
+	}
+	std::vector<tt_entry_t> kept;
+	for (int i = 0; i < TT_SIZE && tt_used; i++) {
+		node_t first = (node_t)TT[i].data;
+		if (TT[i].data && MEMORY[first].mv == FORWARDED) {
+			kept.push_back({ TT[i].key, (TT[i].data & ~0xFFFFFFFFULL) | MEMORY[first].child });
+		}
+	}
+	std::copy(copy.begin(), copy.end(), MEMORY);
+	std::copy(visits.begin(), visits.end(), VISITS);
+	std::copy(score.begin(), score.end(), SCORE);
+	std::copy(proven.begin(), proven.end(), PROVEN);
+	if (RAVE) {
+		std::copy(amaf_visits.begin(), amaf_visits.end(), AMAF_VISITS);
+		std::copy(amaf_score.begin(), amaf_score.end(), AMAF_SCORE);
+	}
+	reset_arena((copy.size() + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	for (tt_entry_t& e : kept) {
+		tt_store(e.key, (node_t)e.data, e.data >> 32);
+	}
+	tree_root = 0;
+}
+
+// Time manager
+// Budgets a move from the remaining time and the increment, in steady clock milliseconds.
+// run_search checks it every TIME_CHECK_PLAYOUTS playouts: past optimum the search stops unless
+// the most visited and the best scoring root child disagree, it never goes past maximum.
+// Before optimum it stops once the most visited child cannot be overtaken at the current speed.
+struct time_manager_t {
+	TimePoint start;
+	TimePoint optimum;
+	TimePoint maximum;
+	bool can_stop_early;
+	const std::atomic<bool>* stop; // Set: the search ignores the clock and runs until *stop
+	int max_playouts; // 0 for no limit
+};
+int TIME_CHECK_PLAYOUTS = 100;
+TimePoint MOVE_OVERHEAD = 30; // Kept for I/O and scheduling
+int MIN_MOVES_LEFT = 5;
+// CodinGame gives 1000 ms for the first answer and 100 ms for the next ones, nothing carries over
+TimePoint CG_FIRST_TURN_MS = 1000;
+TimePoint CG_TURN_MS = 100;
+int FIXED_PLAYOUTS = 0; // When set get_best_move ignores the clock and runs this many playouts
+TimePoint FIXED_MOVE_MS = 0; // When set get_best_move searches exactly this long, without overhead or phase scaling
+
+inline int stones_on_board(const game_t& g) {
+	int n = 0;
+	for (int i = 0; i < 9; i++) {
+		n += POPCNT[stones_from_miniboard[g.b[i]][0] | stones_from_miniboard[g.b[i]][1]];
+	}
+	return n;
+}
+
+// Always searches for ms
+void init_fixed_time(time_manager_t& tm, TimePoint ms) {
+	tm.start = now();
+	tm.optimum = ms;
+	tm.maximum = ms;
+	tm.can_stop_early = false;
+	tm.stop = nullptr;
+	tm.max_playouts = 0;
+}
+
+void init_fixed_playouts(time_manager_t& tm, int playouts) {
+	init_fixed_time(tm, 3600 * 1000);
+	tm.max_playouts = playouts;
+}
+
+// Searches until stop is set
+void init_stop_flag(time_manager_t& tm, const std::atomic<bool>& stop) {
+	init_fixed_time(tm, 0);
+	tm.stop = &stop;
+}
+
+// remaining is the time left before this move, increment is added for this move.
+// Middlegame moves get more time than the opening, where the book and early moves matter less.
+void init_time_manager(time_manager_t& tm, TimePoint remaining, TimePoint increment, const game_t& game) {
+	tm.start = now();
+	int moves_left = std::max(MIN_MOVES_LEFT, empty_cells(game) / 4);
+	TimePoint per_move = std::max<TimePoint>(1, remaining / moves_left + increment - MOVE_OVERHEAD);
+	int stones = stones_on_board(game);
+	float phase = stones < 10 ? 0.8f : stones < 40 ? 1.2f : 0.9f;
+	tm.optimum = std::max<TimePoint>(1, per_move * 0.7f * phase);
+	tm.maximum = std::max<TimePoint>(1, std::min(remaining + increment - MOVE_OVERHEAD, 2 * tm.optimum));
+	tm.optimum = std::min(tm.optimum, tm.maximum);
+	tm.can_stop_early = true;
+	tm.stop = nullptr;
+	tm.max_playouts = 0;
+}
+
+bool time_to_stop(const time_manager_t& tm, node_t root, int done) {
+	if (tm.stop) {
+		return tm.stop->load(std::memory_order_relaxed);
+	}
+	if (tm.max_playouts && done >= tm.max_playouts) {
+		return true;
+	}
+	TimePoint elapsed = now() - tm.start;
+	if (elapsed >= tm.maximum) {
+		return true;
+	}
+	if (!tm.can_stop_early) {
+		return elapsed >= tm.optimum;
+	}
+	int most = 0;
+	int second = 0;
+	node_t most_visited = NULL_NODE;
+	node_t best_mean = NULL_NODE;
+	node_t first = MEMORY[root].child;
+	for (node_t child = first; child < first + load_nchild(root); child++) {
+		int visits = load_relaxed(VISITS[child]);
+		if (visits > most) {
+			second = most;
+			most = visits;
+			most_visited = child;
+		}
+		else if (visits > second) {
+			second = visits;
+		}
+		if (best_mean == NULL_NODE || node_mean(child) > node_mean(best_mean)) {
+			best_mean = child;
+		}
+	}
+	if (elapsed >= tm.optimum) {
+		return most_visited == best_mean;
+	}
+	float left = (float)done * (tm.optimum - elapsed) / std::max<TimePoint>(elapsed, 1);
+	return most - second > left;
+}
+
+// Bounded memory
+// A search that could not allocate prunes its tree between two batches of playouts when it is
+// alone on it and the transposition table is off: nodes with fewer than a threshold of visits
+// become leaves again with their statistics, the blocks below them go to the free lists.
+// The threshold doubles until 1 / PRUNE_FRACTION of the arena has been freed.
+bool ARENA_RECYCLE = true; // Otherwise a full arena only stops the expansions
+const int PRUNE_MIN_VISITS = 2;
+const int PRUNE_FRACTION = 4;
+
+// Frees every block below node and makes it a leaf, returns the nodes freed
+long long free_subtree(node_t node) {
+	mcnode_t& n = MEMORY[node];
+	long long freed = n.nchild;
+	for (node_t c = n.child; c < n.child + n.nchild; c++) {
+		freed += free_subtree(c);
+	}
+	if (n.nchild) {
+		free_block(n.child, n.nchild); // The unused tail of a LAZY_PENDING block waits for the next compaction
+	}
+	n.child = NULL_NODE;
+	n.nchild = 0;
+	n.expanding = 0;
+	return freed;
+}
+
+long long prune_below(node_t node, int threshold) {
+	long long freed = 0;
+	for (node_t c = MEMORY[node].child; c < MEMORY[node].child + MEMORY[node].nchild; c++) {
+		freed += VISITS[c] < threshold ? free_subtree(c) : prune_below(c, threshold);
+	}
+	return freed;
+}
+
+// Merges adjacent free blocks, splitting and freeing blocks of every size fragments the lists
+void coalesce_free_blocks() {
+	std::vector<std::pair<node_t, int>> blocks;
+	for (int size = 1; size < 82; size++) {
+		for (node_t first = free_blocks[size]; first != NULL_NODE; first = MEMORY[first].child) {
+			blocks.push_back({ first, size });
+		}
+		free_blocks[size] = NULL_NODE;
+	}
+	free_nodes = 0;
+	std::sort(blocks.begin(), blocks.end());
+	for (size_t i = 0; i < blocks.size();) {
+		node_t first = blocks[i].first;
+		node_t end = first + blocks[i].second;
+		for (i++; i < blocks.size() && blocks[i].first == end; i++) {
+			end += blocks[i].second;
+		}
+		for (; first < end; first += std::min(end - first, 81u)) {
+			free_block(first, std::min(end - first, 81u));
+		}
+	}
+}
+
+void prune_tree(node_t root) {
+	long long target = arena_capacity() / PRUNE_FRACTION;
+	long long freed = 0;
+	for (int threshold = PRUNE_MIN_VISITS; freed < target && threshold <= VISITS[root]; threshold *= 2) {
+		freed += prune_below(root, threshold);
+	}
+	if (free_epoch == MEMORY_EPOCH) {
+		coalesce_free_blocks();
+	}
+	arena_exhausted = false;
+	arena_prunes.fetch_add(1, std::memory_order_relaxed);
+	arena_freed.fetch_add(freed, std::memory_order_relaxed);
+}
+
+// Parallel search
+// THREADS threads run do_playout, the calling thread being one of them.
+// TREE_PARALLEL: all threads share the same tree.
+// ROOT_PARALLEL: every thread grows its own tree in its own slice of MEMORY,
+// root children statistics are summed once the search is over.
+enum parallel_mode_t { TREE_PARALLEL, ROOT_PARALLEL };
+parallel_mode_t PARALLEL_MODE = TREE_PARALLEL;
+int THREADS = 1;
+std::atomic<bool> search_stop(false);
+std::atomic<int> search_playouts(0);
+
+// With nb_chunks > 0 the worker searches a tree of its own, returned through own_root
+void search_worker(node_t root, const board_t b, unsigned long long seed, int first_chunk, int nb_chunks, node_t* own_root) {
+	game_t local;
+	init_game(local, b);
+	seed_rng(thread_rng, seed);
+	if (nb_chunks > 0) {
+		set_arena_slice(first_chunk, nb_chunks);
+		node_t own = allocate(1);
+		init_node(own, MEMORY[root].mv, MEMORY[root].player);
+		*own_root = own;
+		root = own;
+	}
+	while (!search_stop.load(std::memory_order_relaxed) && !load_relaxed(PROVEN[root])) {
+		for (int i = 0; i < TIME_CHECK_PLAYOUTS; i++) {
+			do_playout(root, local);
+		}
+		search_playouts.fetch_add(TIME_CHECK_PLAYOUTS, std::memory_order_relaxed);
+		if (arena_exhausted && recycle_active) {
+			prune_tree(root);
+		}
+	}
+	STAT(merge_stats());
+}
+
+// Adds the root children statistics of other to the matching children of root
+void merge_root(node_t root, node_t other) {
+	VISITS[root] += VISITS[other];
+	for (int i = 0; i < MEMORY[other].nchild; i++) {
+		node_t oc = MEMORY[other].child + i;
+		for (int j = 0; j < MEMORY[root].nchild; j++) {
+			node_t c = MEMORY[root].child + j;
+			if (MEMORY[c].mv == MEMORY[oc].mv) {
+				VISITS[c] += VISITS[oc];
+				SCORE[c] += SCORE[oc];
+				PROVEN[c] = std::max(PROVEN[c], PROVEN[oc]);
+				if (RAVE) {
+					AMAF_VISITS[c] += AMAF_VISITS[oc];
+					AMAF_SCORE[c] += AMAF_SCORE[oc];
+				}
+				break;
+			}
+		}
+	}
+}
+
+// Runs playouts from root until tm says so or root is proven, returns the number of playouts.
+// Without prove nothing but the game ends is proven, the root is searched until tm says so.
+int run_search(node_t root, board_t b, int nb_threads, const time_manager_t& tm, bool prove = true) {
+	STAT(unsigned long long start_ticks = __rdtsc());
+	STAT(auto start_time = std::chrono::steady_clock::now());
+	search_stop = false;
+	search_playouts = 0;
+	game_t game;
+	init_game(game, b);
+	bool split = PARALLEL_MODE == ROOT_PARALLEL && nb_threads > 1;
+	// Chunks before MEMORY_CHUNK hold the tree kept from the previous turn
+	int first_free = std::min(MEMORY_CHUNK.load(), (long long)NB_CHUNKS);
+	int slice = split ? (NB_CHUNKS - first_free) / nb_threads : 0;
+	if (split && slice == 0) { // No room for the other trees
+		split = false;
+		nb_threads = 1;
+	}
+	proofs_active = prove;
+	lazy_active = LAZY_EXPANSION && (nb_threads == 1 || split);
+	rave_active = RAVE && LEAF_ROLLOUTS == 1;
+	tt_active = USE_TT && !split && !lazy_active;
+	recycle_active = ARENA_RECYCLE && (nb_threads == 1 || split) && !tt_active;
+	arena_exhausted = false;
+	// The other trees are merged only once the search is over, the main root alone cannot decide
+	time_manager_t limits = tm;
+	if (split) {
+		set_arena_slice(first_free, slice);
+		limits.can_stop_early = false;
+	}
+	// The root compares all its moves
+	while (MEMORY[root].expanding == LAZY_PENDING) {
+		if (widen_node(root, game) == NULL_NODE) {
+			break;
+		}
+	}
+	std::vector<node_t> roots(nb_threads, NULL_NODE);
+	std::vector<std::thread> workers;
+	for (int i = 1; i < nb_threads; i++) {
+		workers.emplace_back(search_worker, root, b, rng_next(thread_rng), first_free + i * slice, slice, &roots[i]);
+	}
+	while (!load_relaxed(PROVEN[root])) {
+		for (int i = 0; i < TIME_CHECK_PLAYOUTS; i++) {
+			do_playout(root, game);
+		}
+		search_playouts.fetch_add(TIME_CHECK_PLAYOUTS, std::memory_order_relaxed);
+		if (arena_exhausted && recycle_active) {
+			prune_tree(root);
+		}
+		if (time_to_stop(limits, root, search_playouts)) {
+			break;
+		}
+	}
+	search_stop = true;
+	for (auto& w : workers) {
+		w.join();
+	}
+	if (split) {
+		// The tree now reaches into the chunks the main slice used, a later search must not reuse them
+		MEMORY_CHUNK = first_free + slice_next;
+		set_arena_slice(0, 0);
+		for (int i = 1; i < nb_threads; i++) {
+			merge_root(root, roots[i]);
+		}
+	}
+	STAT(thread_stats.ticks += __rdtsc() - start_ticks);
+	STAT(thread_stats.micros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count());
+	STAT(merge_stats());
+	return search_playouts;
+}
+
+#ifdef USE_STATS
+void print_histogram(const char* name, const long long* counts, int n) {
+	while (n > 1 && !counts[n - 1]) {
+		n--;
 	}
-
-	for (int j = 0; j < 9; j++)
-		board[j] = cp[j];
-	return status;
+	cerr << ", \"" << name << "\": [";
+	for (int i = 0; i < n; i++) {
+		cerr << (i ? ", " : "") << counts[i];
+	}
+	cerr << "]";
 }
 
-void do_playout(mcnode_t* node, board_t board) {
-	// 1. Selection
-	mcnode_t* root = node;
-	//int depth = 0;
-	while (true) {
-		//cout << node << " " << node->mv << " " << node->wins << "/" << node->visits << endl;
-		if (!node->child) { // is leaf
-							//cerr << "Looks like a leaf" << endl;
-			break;
-		}
-		//cerr << "Picking uct node from " << node << endl;
-		node = pick_uct_node(node);
-		apply_move(board, node->mv, node->player);
-		//cerr << "Applying " << node->mv << endl;
+// One JSON line with the statistics gathered since the previous call, then resets them
+void print_stats(node_t root, int playouts) {
+	const search_stats_t& st = search_stats;
+	double ticks_per_ms = st.micros > 0 ? st.ticks * 1000.0 / st.micros : 1;
+	long long used = std::min((long long)NB_CHUNKS, MEMORY_CHUNK.load() + st.slice_chunks);
+	cerr << "{\"playouts\": " << playouts << ", \"search_ms\": " << st.micros / 1000.0 << ", \"phase_ms\": {";
+	for (int i = 0; i < NB_PHASES; i++) {
+		cerr << (i ? ", \"" : "\"") << STAT_PHASE_NAMES[i] << "\": " << st.cycles[i] / ticks_per_ms;
 	}
+	cerr << "}";
+	print_histogram("depth", st.depth, MAX_DEPTH + 1);
+	print_histogram("rollout_plies", st.rollout, 82);
+	print_histogram("branching", st.branching, 82);
+	cerr << ", \"arena\": {\"chunks\": " << used << ", \"capacity\": " << NB_CHUNKS
+		<< ", \"occupancy\": " << (double)used / NB_CHUNKS << ", \"failures\": " << arena_failures << ", \"prunes\": " << arena_prunes << ", \"freed\": " << arena_freed << "}";
+	cerr << ", \"root\": [";
+	node_t first = MEMORY[root].child;
+	for (node_t child = first; child < first + MEMORY[root].nchild; child++) {
+		cerr << (child > first ? ", " : "") << "{\"mv\": " << (int)MEMORY[child].mv << ", \"visits\": " << VISITS[child] << ", \"mean\": " << node_mean(child) << "}";
+	}
+	cerr << "]}" << endl;
+	search_stats = search_stats_t();
+}
+#endif
 
-	// 2. Expand
-	int status = get_status(board);
-	mcnode_t* random_child;
-	int result;
-	if (status == NOT_OVER) {
-		random_child = expand_nodes(node, board);
-		apply_move(board, random_child->mv, random_child->player);
-		// 3. Simulation
-		result = simulate(random_child, board); // TODO: Either win or lose ? Should be expected score maybe ? win draw lose..
-		node = random_child;
+int playouts = 0;
+// remaining and increment are passed to the time manager
+move_t get_best_move(board_t b, move_t last_move, int player, TimePoint remaining, TimePoint increment) {
+	game_t game;
+	init_game(game, b);
+	time_manager_t tm;
+	if (FIXED_PLAYOUTS > 0) {
+		init_fixed_playouts(tm, FIXED_PLAYOUTS);
+	}
+	else if (FIXED_MOVE_MS > 0) {
+		init_fixed_time(tm, FIXED_MOVE_MS);
 	}
 	else {
-		result = status;// already have result
+		init_time_manager(tm, remaining, increment, game);
 	}
-
-	float val = 0;
-	if (result == (3 + node->player) / 2) {
-		val = 1.0f;
+	int value = -1;
+	if (empty_cells(game) <= ENDGAME_ROOT_EMPTY) {
+		move_t best;
+		value = solve_endgame(game, last_move, player, 1 << 30, tm.start + std::min(ENDGAME_ROOT_MS, tm.optimum / 2), best);
+#ifndef AT_HOME
+		cerr << "endgame " << value << " nodes " << solver_nodes << endl;
+#endif
+		if (value >= 1) {
+			playouts = 0;
+			return best;
+		}
 	}
-	else if (result == 0) {
-		val = 0.5f;
+	bool reuse = tree_root != NULL_NODE && MEMORY[tree_root].mv == last_move && MEMORY[tree_root].player == -player;
+	// A lost position is searched without proofs on a fresh tree, the mean scores then rank the moves
+	// most likely to make the opponent err
+	bool lost = value == 0 || (reuse && PROVEN[tree_root] == PROVEN_WIN);
+	if (reuse && !lost) {
+		compact_tree();
+		reused_visits = VISITS[tree_root];
 	}
+	else {
+		reset_arena(0);
+		tree_root = allocate(1);
+		init_node(tree_root, last_move, -player);
+		reused_visits = 0;
+	}
+	// A leaf proven by the solver during the last search has no children, the search proves it again from them
+	if (PROVEN[tree_root] && !MEMORY[tree_root].nchild) {
+		PROVEN[tree_root] = UNPROVEN;
+	}
+	playouts = run_search(tree_root, b, THREADS, tm, !lost);
+	STAT(print_stats(tree_root, playouts));
+	//print_mcnode(tree_root, 0);
 
-	// 4. Backpropagation
-	while (node != root) {
-		undo_move(board, node->mv, node->player);
-		node->visits += 1;
-		node->mean += (val - node->mean) / node->visits;
-		node->invsqrtvisits = 1 / std::sqrt(node->visits);
-#ifdef USE_LOGINT
-		float logpvis = std::sqrt(log2_32(node->parent->visits + 1));
-#else
-		float logpvis = std::sqrt(std::log2(node->parent->visits + 1));
-#endif
-		for (mcnode_t* i = node->parent->child; i; i = i->next) {
-			if (i->visits > 0) {
-				i->upper = i->mean + C * logpvis * i->invsqrtvisits;
-			}
-		}
+	//getchar();
+	move_t best = pick_best_move(tree_root);
+	return best != NULL_MOVE ? best : get_random_move(b, last_move, player);
+}
 
-		node = node->parent;
-		val = 1 - val;
-	}
-	node->visits += 1;
-	node->invsqrtvisits = 1 / std::sqrt(node->visits);
-	//node->mean += (val - node->mean) / node->visits;
+// Pondering
+// While play_CG waits for the opponent, a thread keeps searching the position after our move.
+// The opponent's move stops it before anything else is touched, then goes through advance_tree
+// like any other move: the search continues from the statistics of the matching subtree.
+bool PONDER = true;
+std::atomic<bool> ponder_stop(false);
+int pondered = 0;
+
+// b must stay untouched until stop_pondering
+void ponder_search(node_t root, const int* b, unsigned long long seed) {
+	seed_rng(thread_rng, seed);
+	board_t local;
+	std::copy(b, b + 9, local);
+	time_manager_t tm;
+	init_stop_flag(tm, ponder_stop);
+	pondered = run_search(root, local, THREADS, tm);
 }
 
-move_t pick_best_move(mcnode_t* root) {
-	float most_visits = -1;
-	mcnode_t* child = root->child;
-	mcnode_t* best = child;
-	while (child) {
-#ifndef AT_HOME
-		cerr << child->mv / 9 << "-" << child->mv % 9 << " v: " << child->visits << " w: " << child->mean << " upper: " << child->upper << endl;
-#endif	
-		if (child->mean > most_visits) {
-			most_visits = child->mean;
-			best = child;
-		}
-		child = child->next;
+// Ponders the position after player played mv
+void start_pondering(std::thread& ponder, board_t b, move_t mv, int player) {
+	if (tree_root == NULL_NODE) {
+		reset_arena(0);
+		tree_root = allocate(1);
+		init_node(tree_root, mv, player);
 	}
-	return best->mv;
+	ponder_stop = false;
+	ponder = std::thread(ponder_search, tree_root, b, rng_next(thread_rng));
 }
 
-int playouts = 0;
-move_t get_best_move(board_t b, move_t last_move, int player) {
-	auto tim = std::clock();
-	mcnode_t root;
-	root.child = 0;
-	root.mv = last_move;
-	root.player = -player;
-	root.visits = 0;
-	root.mean = 0;
-	for (playouts = 0;; playouts++) {
-		if (playouts % 100 == 0) {
-			if ((10000.0f * (std::clock() - tim)) / CLOCKS_PER_SEC > 490) {
-				break;
-			}
-		}
-		do_playout(&root, b);
+void stop_pondering(std::thread& ponder) {
+	if (ponder.joinable()) {
+		ponder_stop = true;
+		ponder.join();
 	}
-	//print_mcnode(&root, 0);
-
-	//getchar();
-	return pick_best_move(&root);
 }
 
 bool openingBook(board_t b, move_t last_move, int turn, move_t& to_play) {
@@ -767,18 +2607,153 @@ bool openingBook(board_t b, move_t last_move, int turn, move_t& to_play) {
 	return false;
 }
 
-void play_CG() {
-	cerr << "init done" << endl;
+// Opening book
+// build_book searches the early positions offline and writes their best moves to a file sorted by
+// position key. The engine maps it at startup and looks positions up by binary search, without parsing.
+// play_CG falls back to the openingBook rules when the file is missing.
+const char* BOOK_FILE = "uttt.book";
+const unsigned int BOOK_VERSION = 1;
+
+struct book_header_t {
+	char magic[8];
+	unsigned int version;
+	unsigned int count;
+};
+
+struct book_entry_t {
+	unsigned long long key; // position_key of the position, the player to move being -(last mover)
+	unsigned int visits; // Root visits of the search
+	unsigned short mean; // Mean score of mv, scaled to 0..65535
+	signed char mv;
+	char pad;
+};
+static_assert(sizeof(book_entry_t) == 16, "book entries are written as is");
+
+const book_entry_t* BOOK = nullptr;
+unsigned int BOOK_SIZE = 0;
+
+bool load_book(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	void* map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(book_header_t)) {
+		map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	const book_header_t* header = (const book_header_t*)map;
+	if (std::string(header->magic, 8) != "UTTTBOOK" || header->version != BOOK_VERSION
+		|| st.st_size != (off_t)(sizeof(book_header_t) + header->count * sizeof(book_entry_t))) {
+		munmap(map, st.st_size);
+		return false;
+	}
+	BOOK = (const book_entry_t*)(header + 1);
+	BOOK_SIZE = header->count;
+	return true;
+}
+
+inline bool book_key_less(const book_entry_t& e, unsigned long long key) {
+	return e.key < key;
+}
+
+inline bool book_entry_less(const book_entry_t& a, const book_entry_t& b) {
+	return a.key < b.key;
+}
+
+inline bool book_entry_same(const book_entry_t& a, const book_entry_t& b) {
+	return a.key == b.key;
+}
+
+bool book_move(board_t b, move_t last_move, int player, move_t& to_play) {
+	if (!BOOK_SIZE) {
+		return false;
+	}
+	game_t game;
+	init_game(game, b);
+	unsigned long long key = position_key(game, last_move, -player);
+	const book_entry_t* e = std::lower_bound(BOOK, BOOK + BOOK_SIZE, key, book_key_less);
+	if (e == BOOK + BOOK_SIZE || e->key != key) {
+		return false;
+	}
+	to_play = e->mv;
+	return true;
+}
+
+// Searches the position for ms, then the width most visited replies down to depth plies
+void build_book_from(board_t b, move_t last_move, int player, int depth, int width, TimePoint ms, std::vector<book_entry_t>& book) {
+	if (get_status(b) != NOT_OVER) {
+		return;
+	}
+	reset_arena(0);
+	node_t root = allocate(1);
+	init_node(root, last_move, -player);
+	time_manager_t tm;
+	init_fixed_time(tm, ms);
+	run_search(root, b, THREADS, tm);
+	game_t game;
+	init_game(game, b);
+	move_t mv = pick_best_move(root);
+	node_t first = MEMORY[root].child;
+	std::vector<std::pair<int, move_t>> replies;
+	for (node_t child = first; child < first + MEMORY[root].nchild; child++) {
+		replies.push_back({ VISITS[child], MEMORY[child].mv });
+		if (MEMORY[child].mv == mv) {
+			book.push_back({ position_key(game, last_move, -player), (unsigned int)VISITS[root], (unsigned short)(node_mean(child) * 65535), (signed char)mv, 0 });
+		}
+	}
+	cerr << "book " << book.size() << " depth " << depth << " move " << mv << " visits " << VISITS[root] << endl;
+	if (depth <= 1) {
+		return;
+	}
+	std::sort(replies.rbegin(), replies.rend());
+	for (int i = 0; i < width && i < (int)replies.size(); i++) {
+		apply_move(b, replies[i].second, player);
+		build_book_from(b, replies[i].second, -player, depth - 1, width, ms, book);
+		undo_move(b, replies[i].second, player);
+	}
+}
+
+// The first player is 1, like in play_CG
+void build_book(const char* path, int depth, int width, TimePoint ms) {
 	board_t b;
 	init_board(b);
+	std::vector<book_entry_t> book;
+	build_book_from(b, NULL_MOVE, 1, depth, width, ms, book);
+	std::sort(book.begin(), book.end(), book_entry_less);
+	book.erase(std::unique(book.begin(), book.end(), book_entry_same), book.end());
+	book_header_t header = { { 'U', 'T', 'T', 'T', 'B', 'O', 'O', 'K' }, BOOK_VERSION, (unsigned int)book.size() };
+	std::ofstream out(path, std::ios::binary);
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)book.data(), book.size() * sizeof(book_entry_t));
+	cerr << "wrote " << book.size() << " positions to " << path << endl;
+}
+
+// Plays from start, the first move read being played by player (1 on CodinGame).
+// The openingBook rules only know the empty board.
+void play_CG(const board_t start, int player, bool rule_book) {
+	cerr << "init done" << endl;
+	if (load_book(BOOK_FILE)) {
+		cerr << "book " << BOOK_SIZE << " positions" << endl;
+	}
+	board_t b;
+	std::copy(start, start + 9, b);
 	move_t last_move = NULL_MOVE;
-	int player = 1;
 	int turn = 0;
-	bool still_in_book = true;
+	bool still_in_book = rule_book;
+	bool first_answer = true;
+	std::thread ponder;
 	while (1) {
 		int opponentRow;
 		int opponentCol;
-		cin >> opponentRow >> opponentCol; cin.ignore();
+		if (!(cin >> opponentRow >> opponentCol)) {
+			return; // The referee closed the pipe
+		}
+		cin.ignore();
 		int validActionCount;
 		cin >> validActionCount; cin.ignore();
 
@@ -787,10 +2762,12 @@ void play_CG() {
 			int col;
 			cin >> row >> col; cin.ignore();
 		}
+		stop_pondering(ponder);
 
 		if (opponentRow != -1) {
 			last_move = opponentRow * 9 + opponentCol;
 			apply_move(b, last_move, player);
+			advance_tree(last_move);
 			player *= -1;
 			turn += 1;
 		}
@@ -804,147 +2781,788 @@ void play_CG() {
 		cerr << "} lm " << last_move;
 		cerr << endl;
 		move_t move_taken;
-		if (still_in_book) {
+		bool from_book = book_move(b, last_move, player, move_taken);
+		if (!from_book && still_in_book) {
 			still_in_book = openingBook(b, last_move, turn, move_taken);
+			from_book = still_in_book;
 		}
-		if (!still_in_book) {
-			nodes = 0;
-			move_taken = get_best_move(b, last_move, player);//IDDFS(b, last_move, player);
+		if (!from_book) {
+			move_taken = get_best_move(b, last_move, player, 0, first_answer ? CG_FIRST_TURN_MS : CG_TURN_MS);//IDDFS(b, last_move, player);
 		}
 		apply_move(b, move_taken, player);
+		advance_tree(move_taken);
 		int col = move_taken % 9;
 		int row = move_taken / 9;
 		cout << row << " " << col << endl;
+		first_answer = false;
 		float taken = 1000 * (std::clock() - tim) / CLOCKS_PER_SEC;
 		if (taken > 0) {
-			cerr << "time " << taken << "ms" << " playouts " << playouts << " kpps " << playouts / taken << " nodes expanded " << nodes << endl;
+			cerr << "time " << taken << "ms" << " playouts " << playouts << " kpps " << playouts / taken << " reused " << reused_visits << " pondered " << pondered << " arena full " << arena_failures << " pruned " << arena_prunes << endl;
+		}
+		if (PONDER) {
+			start_pondering(ponder, b, move_taken, player);
 		}
 		player *= -1;
 		turn += 1;
 	}
 }
 
+// Benchmark suite
+// Every component runs on every position BENCH_WARMUP + BENCH_REPS times from the same seed, the arena
+// and both tables cleared, so repetitions do the same work and only the timing varies. Results go to stdout as JSON, one
+// object per component and position. p95 is the rate of the 95th percentile slowest repetition.
+struct bench_position_t {
+	const char* name;
+	board_t b;
+	move_t last_move;
+	int player; // To move
+};
+
+const bench_position_t BENCH_POSITIONS[] = {
+	{ "opening", { 7047, 27, 0, 8, 0, 27, 0, 0, 13365 }, 71, 1 },
+	{ "legacy", { 0, 0, 0, 0, 891, 0, 12393, 729, 6 }, 61, -1 }, // The position of the old bench()
+	{ "middlegame", { 7155, 47, 7101, 13373, 4374, 13649, 0, 246, 17751 }, 58, 1 },
+	{ "endgame", { 7155, 1667, 7101, 13508, 17526, 15107, 9720, 408, 19209 }, 72, 1 },
+};
+int BENCH_REPS = 10;
+int BENCH_WARMUP = 1;
+unsigned long BENCH_SEED = 1;
+long long bench_sink = 0; // Keeps results alive
+
+// Each kernel runs n operations from the position, the arena having just been reset
+typedef void (*bench_kernel_t)(game_t& game, move_t last_move, int player, int n);
+
+// Random game steps: fast_moves, a pick among its moves and apply_move, restarting at the end of a game
+void bench_movegen(game_t& start, move_t start_move, int start_player, int n) {
+	game_t game = start;
+	move_t last_move = start_move;
+	int player = start_player;
+	for (int i = 0; i < n; i++) {
+		unsigned long long first_part = 0;
+		int second_part = 0;
+		int nb = fast_moves(game.b, last_move, first_part, second_part);
+		bench_sink += nb;
+		if (nb == 0 || get_status(game) != NOT_OVER) {
+			game = start;
+			last_move = start_move;
+			player = start_player;
+			continue;
+		}
+		int k = rng_below(thread_rng, nb);
+		int bit;
+		while (true) {
+			bit = first_part ? __builtin_ctzll(first_part) : 63 + __builtin_ctz(second_part);
+			if (k-- == 0) {
+				break;
+			}
+			if (first_part) {
+				first_part &= first_part - 1;
+			}
+			else {
+				second_part &= second_part - 1;
+			}
+		}
+		last_move = movegen_to_move[bit];
+		apply_move(game, last_move, player);
+		player = -player;
+	}
+}
+
+void bench_rollout(game_t& game, move_t last_move, int player, int n) {
+	for (int i = 0; i < n; i++) {
+		bench_sink += simulate(game, last_move, player);
+	}
+}
+
+void bench_full_playout(game_t& game, move_t last_move, int player, int n) {
+	node_t root = allocate(1);
+	init_node(root, last_move, -player);
+	for (int i = 0; i < n; i++) {
+		do_playout(root, game);
+	}
+}
+
+int simulate_none(const game_t&, move_t, int) {
+	return rng_below(thread_rng, 3);
+}
+
+// Playouts with a random result instead of the rollout and without the endgame solver
+void bench_select_backprop(game_t& game, move_t last_move, int player, int n) {
+	int (*rollout)(const game_t&, move_t, int) = simulate;
+	int endgame = ENDGAME_EMPTY;
+	simulate = simulate_none;
+	ENDGAME_EMPTY = -1;
+	bench_full_playout(game, last_move, player, n);
+	simulate = rollout;
+	ENDGAME_EMPTY = endgame;
+}
+
+// Rate of the repetition at fraction q of the repetitions sorted from fastest to slowest
+inline double bench_rate(std::vector<double> seconds, long long ops, double q) {
+	std::sort(seconds.begin(), seconds.end());
+	int i = std::min((int)seconds.size() - 1, std::max(0, (int)std::ceil(q * seconds.size()) - 1));
+	return ops / seconds[i];
+}
+
+void bench_component(const char* name, bench_kernel_t kernel, int n, const bench_position_t& pos, bool last) {
+	std::vector<double> seconds;
+	long long arena = 0;
+	for (int rep = 0; rep < BENCH_WARMUP + BENCH_REPS; rep++) {
+		reset_arena(0);
+		solver_clear(); // The solver table is kept across searches, leaves it proved would be free on the next repetition
+		seed_rng(thread_rng, BENCH_SEED);
+		game_t game;
+		init_game(game, pos.b);
+		auto start = std::chrono::steady_clock::now();
+		kernel(game, pos.last_move, pos.player, n);
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (rep >= BENCH_WARMUP) {
+			seconds.push_back(elapsed);
+		}
+		arena = arena_used();
+	}
+	long long bytes = arena * NODE_BYTES;
+	cout << "    { \"component\": \"" << name << "\", \"position\": \"" << pos.name << "\", \"ops\": " << n
+		<< ", \"ops_per_sec_median\": " << (long long)bench_rate(seconds, n, 0.5)
+		<< ", \"ops_per_sec_p95\": " << (long long)bench_rate(seconds, n, 0.95)
+		<< ", \"nodes_per_sec_median\": " << (long long)bench_rate(seconds, arena, 0.5)
+		<< ", \"arena_bytes\": " << bytes << " }" << (last ? "" : ",") << endl;
+}
+
+// Playouts per second are the ops of the full_playout component
 void bench() {
+	struct {
+		const char* name;
+		bench_kernel_t kernel;
+		int n;
+	} components[] = {
+		{ "movegen", bench_movegen, 1000000 },
+		{ "rollout", bench_rollout, 20000 },
+		{ "select_backprop", bench_select_backprop, 100000 },
+		{ "full_playout", bench_full_playout, 50000 },
+	};
+	int nb_components = sizeof(components) / sizeof(components[0]);
+	int nb_positions = sizeof(BENCH_POSITIONS) / sizeof(BENCH_POSITIONS[0]);
+	cout << "{" << endl;
+	cout << "  \"reps\": " << BENCH_REPS << ", \"warmup\": " << BENCH_WARMUP << ", \"seed\": " << BENCH_SEED
+		<< ", \"avx2\": " << (simulate_batch == simulate_batch_avx2 ? "true" : "false")
+		<< ", \"bmi2\": " << (simulate == simulate_bitboard ? "true" : "false") << "," << endl;
+	cout << "  \"results\": [" << endl;
+	for (int c = 0; c < nb_components; c++) {
+		for (int p = 0; p < nb_positions; p++) {
+			bool last = c == nb_components - 1 && p == nb_positions - 1;
+			bench_component(components[c].name, components[c].kernel, components[c].n, BENCH_POSITIONS[p], last);
+		}
+	}
+	cout << "  ]" << endl << "}" << endl;
+}
+
+// Perft
+// Counts the leaves depth plies below a position with each move generator:
+// moves(), the fast_moves masks, nth_move indexing as used by get_random_move and the rollout bitboards.
+// perft_verify compares the move sets of all four at every node, perft_suite also times each one alone.
+enum perft_gen_t { GEN_MOVES, GEN_FAST_MOVES, GEN_NTH_MOVE, GEN_BITBOARD };
+const char* PERFT_GEN_NAMES[] = { "moves", "fast_moves", "nth_move", "bitboard" };
+
+// Legal moves of the position in list, returns their number
+int perft_moves(game_t& g, move_t last_move, perft_gen_t gen, move_t* list) {
+	unsigned long long first_part = 0;
+	int second_part = 0;
+	int nb = 0;
+	if (gen == GEN_MOVES) {
+		movelist_t mvlist = last_move == NULL_MOVE ? get_all_moves() : moves(g.b, last_move);
+		std::copy(mvlist.begin(), mvlist.end(), list);
+		return mvlist.size();
+	}
+	if (gen == GEN_BITBOARD) {
+		bitpos_t p;
+		init_bitpos(p, g);
+		bitboard_t mvs = moves_bitboard(p, last_move == NULL_MOVE ? 9 : max_from_move[last_move]);
+		for (; mvs; mvs &= mvs - 1) {
+			unsigned long long lo = (unsigned long long)mvs;
+			list[nb++] = movegen_to_move[lo ? __builtin_ctzll(lo) : 64 + __builtin_ctzll((unsigned long long)(mvs >> 64))];
+		}
+		return nb;
+	}
+	if (last_move == NULL_MOVE) {
+		first_part = 0xFFFFFFFFFFFFFFFF;
+		second_part = 0x3FFFF;
+		nb = 81;
+	}
+	else {
+		nb = fast_moves(g.b, last_move, first_part, second_part);
+	}
+	if (gen == GEN_NTH_MOVE) {
+		for (int i = 0; i < nb; i++) {
+			list[i] = nth_move(first_part, second_part, i);
+		}
+		return nb;
+	}
+	nb = 0;
+	for (int i = 0; i < 81; i++) {
+		if (i < 63 ? (first_part >> i) & 1 : (second_part >> (i - 63)) & 1) {
+			list[nb++] = movegen_to_move[i];
+		}
+	}
+	return nb;
+}
+
+long long perft(game_t& g, move_t last_move, int player, int depth, perft_gen_t gen) {
+	if (depth == 0) {
+		return 1;
+	}
+	if (get_status(g) != NOT_OVER) {
+		return 0;
+	}
+	move_t list[81];
+	int nb = perft_moves(g, last_move, gen, list);
+	long long leaves = 0;
+	for (int i = 0; i < nb; i++) {
+		apply_move(g, list[i], player);
+		leaves += perft(g, list[i], -player, depth - 1, gen);
+		undo_move(g, list[i], player);
+	}
+	return leaves;
+}
+
+// The rollout path keeps its own state: bitboards updated by apply_move_bitboard, status included
+__attribute__((target("bmi,bmi2,popcnt")))
+long long perft_bitboard(const bitpos_t& p, int next, int id, int depth) {
+	if (depth == 0) {
+		return 1;
+	}
+	bitboard_t mvs = moves_bitboard(p, next);
+	int nb = _mm_popcnt_u64((unsigned long long)mvs) + _mm_popcnt_u64((unsigned long long)(mvs >> 64));
+	long long leaves = 0;
+	for (int k = 0; k < nb; k++) {
+		int bit = nth_bit(mvs, k);
+		bitpos_t child = p;
+		if (apply_move_bitboard(child, bit, id) != NOT_OVER) {
+			leaves += depth == 1;
+		}
+		else {
+			leaves += perft_bitboard(child, bit % 9, id ^ 1, depth - 1);
+		}
+	}
+	return leaves;
+}
+
+// Returns -1 after printing the first position where the generators disagree
+long long perft_verify(game_t& g, move_t last_move, int player, int depth) {
+	if (depth == 0) {
+		return 1;
+	}
+	if (get_status(g) != NOT_OVER) {
+		return 0;
+	}
+	move_t lists[4][81];
+	int nbs[4];
+	for (int gen = 0; gen < 4; gen++) {
+		nbs[gen] = perft_moves(g, last_move, (perft_gen_t)gen, lists[gen]);
+		std::sort(lists[gen], lists[gen] + nbs[gen]);
+	}
+	for (int gen = 1; gen < 4; gen++) {
+		if (nbs[gen] != nbs[0] || !std::equal(lists[gen], lists[gen] + nbs[gen], lists[0])) {
+			cerr << "perft: " << PERFT_GEN_NAMES[gen] << " disagrees with moves() after " << last_move << " on ";
+			print_wholeboard_filled(g.b);
+			return -1;
+		}
+	}
+	long long leaves = 0;
+	for (int i = 0; i < nbs[0]; i++) {
+		apply_move(g, lists[0][i], player);
+		long long sub = perft_verify(g, lists[0][i], -player, depth - 1);
+		undo_move(g, lists[0][i], player);
+		if (sub < 0) {
+			return -1;
+		}
+		leaves += sub;
+	}
+	return leaves;
+}
+
+// Prints leaves and nodes per second of every generator, returns false if any disagree
+bool perft_suite(int max_depth) {
+	bool ok = true;
+	int nb_positions = sizeof(BENCH_POSITIONS) / sizeof(BENCH_POSITIONS[0]);
+	for (int p = -1; p < nb_positions; p++) {
+		const char* name = p < 0 ? "empty" : BENCH_POSITIONS[p].name;
+		board_t b;
+		init_board(b);
+		move_t last_move = p < 0 ? NULL_MOVE : BENCH_POSITIONS[p].last_move;
+		int player = p < 0 ? 1 : BENCH_POSITIONS[p].player;
+		if (p >= 0) {
+			std::copy(BENCH_POSITIONS[p].b, BENCH_POSITIONS[p].b + 9, b);
+		}
+		game_t g;
+		init_game(g, b);
+		for (int depth = 1; depth <= max_depth; depth++) {
+			long long expected = perft_verify(g, last_move, player, depth);
+			cerr << "perft " << name << " depth " << depth << " leaves " << expected;
+			for (int gen = 0; gen < 4; gen++) {
+				auto start = std::chrono::steady_clock::now();
+				long long leaves;
+				if (gen == GEN_BITBOARD && simulate == simulate_bitboard) {
+					bitpos_t bp;
+					init_bitpos(bp, g);
+					leaves = perft_bitboard(bp, last_move == NULL_MOVE ? 9 : max_from_move[last_move], play_id_table[player + 1] - 1, depth);
+				}
+				else {
+					leaves = perft(g, last_move, player, depth, (perft_gen_t)gen);
+				}
+				double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				ok = ok && expected >= 0 && leaves == expected;
+				cerr << " " << PERFT_GEN_NAMES[gen] << " " << (leaves == expected ? "" : "MISMATCH ") << (long long)(leaves / std::max(elapsed, 1e-9)) << "/s";
+			}
+			cerr << endl;
+		}
+	}
+	cerr << (ok ? "perft ok" : "perft FAILED") << endl;
+	return ok;
+}
+
+// kpps on the bench() position for 1 to max_threads threads, in both parallel modes
+void bench_threads(int max_threads) {
 	board_t b = { 0, 0, 0, 0, 891, 0, 12393, 729, 6 };
+	move_t last_move = 61;
+	int player = -1;
+
+	for (parallel_mode_t mode : { TREE_PARALLEL, ROOT_PARALLEL }) {
+		PARALLEL_MODE = mode;
+		for (int threads = 1; threads <= max_threads; threads++) {
+			reset_arena(0);
+			node_t root = allocate(1);
+			init_node(root, last_move, -player);
+			time_manager_t tm;
+			init_fixed_time(tm, 1000);
+			int done = run_search(root, b, threads, tm);
+			cerr << (mode == TREE_PARALLEL ? "tree" : "root") << " threads " << threads << " playouts " << done << " kpps " << done / 1000.0f << endl;
+		}
+	}
+	PARALLEL_MODE = TREE_PARALLEL;
+}
+
+void bench_rollout_kernel(const char* name, void (*kernel)(const game_t&, move_t, int, int*), const game_t& game, move_t last_move, int player) {
+	const int batches = 100000;
+	int results[SIMD_LANES];
+	int wins[3] = { 0, 0, 0 };
+	auto tim = now();
+	for (int i = 0; i < batches; i++) {
+		kernel(game, last_move, player, results);
+		for (int j = 0; j < SIMD_LANES; j++)
+			wins[results[j]]++;
+	}
+	auto time = std::max<TimePoint>(now() - tim, 1);
+	cerr << name << " rollouts " << batches * SIMD_LANES << " kpps " << batches * SIMD_LANES / time << " results " << wins[0] << "/" << wins[1] << "/" << wins[2] << endl;
+}
 
+// Rollouts per second from the bench() position with every rollout implementation
+void bench_rollouts() {
+	board_t b = { 0, 0, 0, 0, 891, 0, 12393, 729, 6 };
 	move_t last_move = 61;
 	int player = -1;
+	game_t game;
+	init_game(game, b);
+
+	auto dispatched = simulate;
+	simulate = simulate_tables;
+	bench_rollout_kernel("tables", simulate_batch_scalar, game, last_move, player);
+	if (__builtin_cpu_supports("bmi2")) {
+		simulate = simulate_bitboard;
+		bench_rollout_kernel("bitboard", simulate_batch_scalar, game, last_move, player);
+	}
+	simulate = dispatched;
+	if (__builtin_cpu_supports("avx2")) {
+		bench_rollout_kernel("avx2 batch", simulate_batch_avx2, game, last_move, player);
+	}
+}
 
-	playouts = 1000;
+// Match harness
+// Engines are forked processes running play_CG over pipes, so every game gets its own copy of the
+// globals: tree, arena, tables and parameters. Worker processes play games concurrently and send
+// their results to the parent, which stops the match as soon as the SPRT accepts a hypothesis.
+struct engine_params_t {
+	float c;
+	float fpu_c;
+	bool use_tt;
+	int leaf_rollouts;
+	int endgame_empty;
+	bool lazy_expansion;
+	bool tactical_rollouts;
+	bool rave;
+	float rave_k;
+};
+
+engine_params_t current_params() {
+	return { C, FPU_C, USE_TT, LEAF_ROLLOUTS, ENDGAME_EMPTY, LAZY_EXPANSION, TACTICAL_ROLLOUTS, RAVE, RAVE_K };
+}
 
-	for (int depth = 0; depth < 4; depth++) {
-		auto tim = std::clock();
-		mcnode_t root;
-		root.child = 0;
-		chit = 0;
-		root.mv = last_move;
-		root.player = -player;
-		root.visits = 0;
-		root.mean = 0;
-		for (int i = 0; i < playouts; i++) {
-			do_playout(&root, b);
-		}
-		auto time = 1000.0f * (std::clock() - tim) / CLOCKS_PER_SEC;
-		auto npms = (float)(playouts) / time;
-		cerr << " time " << time << " playouts " << playouts << " kpps " << npms << " calls " << calls << endl;
-		// cerr << minlog << " " << maxlog << " " << minsqrt << " " << maxsqrt << endl;
-		//print_mcnode(&root, 0, root.visits/100);
-		//print_wholeboard_filled(b);
-		playouts *= 10;
-		//getchar();
-	}
-}
-
-int play_tour(int me) {
+void apply_params(const engine_params_t& p) {
+	C = p.c;
+	FPU_C = p.fpu_c;
+	USE_TT = p.use_tt;
+	LEAF_ROLLOUTS = p.leaf_rollouts;
+	ENDGAME_EMPTY = p.endgame_empty;
+	LAZY_EXPANSION = p.lazy_expansion;
+	TACTICAL_ROLLOUTS = p.tactical_rollouts;
+	RAVE = p.rave;
+	RAVE_K = p.rave_k;
+}
+
+struct match_settings_t {
+	int games; // Upper bound, the SPRT usually stops before
+	int concurrency; // Games played at once
+	int playouts; // Per move, 0 to play on time
+	TimePoint move_ms; // Per move when playouts is 0
+	int opening_plies; // Random plies played before the engines take over
+	double elo0, elo1; // SPRT hypotheses
+	double alpha, beta; // SPRT error rates
+};
+
+const int OPENING_CHECK_PLAYOUTS = 2000;
+const float OPENING_MIN_MEAN = 0.4f; // Openings whose best move scores outside this range are skewed
+const float OPENING_MAX_MEAN = 0.6f;
+const TimePoint MATCH_PLAYOUTS_TIMEOUT = 60 * 1000; // An engine silent for longer loses
+const int MATCH_TIMEOUT_FACTOR = 5; // Same when playing on time, with slack for a loaded machine
+
+struct engine_process_t {
+	pid_t pid;
+	int in; // Engine's stdin
+	int out; // Engine's stdout
+};
+
+struct match_result_t {
+	int game;
+	int result; // For the first engine of the match
+};
+
+// The engine plays from start, the first move it reads being played by player
+engine_process_t spawn_engine(const engine_params_t& params, const match_settings_t& s, unsigned long seed, const board_t start, int player) {
+	int to_engine[2];
+	int from_engine[2];
+	if (pipe(to_engine) || pipe(from_engine)) {
+		perror("pipe");
+		exit(1);
+	}
+	cout.flush();
+	cerr.flush();
+	pid_t pid = fork();
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(to_engine[0], 0);
+		dup2(from_engine[1], 1);
+		dup2(null_fd, 2);
+		close(null_fd);
+		close(to_engine[0]);
+		close(to_engine[1]);
+		close(from_engine[0]);
+		close(from_engine[1]);
+		apply_params(params);
+		PONDER = false;
+		THREADS = 1;
+		FIXED_PLAYOUTS = s.playouts;
+		FIXED_MOVE_MS = s.move_ms;
+		seed_rng(thread_rng, seed);
+		init_arena(ARENA_BYTES, 0); // A fresh mapping, the pages of the match process are not shared copy on write
+		reset_tree();
+		play_CG(start, player, false);
+		_exit(0);
+	}
+	close(to_engine[0]);
+	close(from_engine[1]);
+	return { pid, to_engine[1], from_engine[0] };
+}
+
+void stop_engine(engine_process_t& e) {
+	close(e.in);
+	close(e.out);
+	kill(e.pid, SIGKILL);
+	waitpid(e.pid, nullptr, 0);
+}
+
+// The CodinGame turn input, without the list of legal moves
+void send_move(const engine_process_t& e, move_t mv) {
+	char buf[32];
+	int len = mv == NULL_MOVE ? snprintf(buf, sizeof(buf), "-1 -1\n0\n") : snprintf(buf, sizeof(buf), "%d %d\n0\n", mv / 9, mv % 9);
+	if (write(e.in, buf, len) != len) {
+		// The engine died, the next read reports it
+	}
+}
+
+bool read_line(int fd, std::string& line, TimePoint timeout) {
+	TimePoint deadline = now() + timeout;
+	line.clear();
+	char ch;
+	while (1) {
+		TimePoint left = deadline - now();
+		pollfd p = { fd, POLLIN, 0 };
+		if (left <= 0 || poll(&p, 1, left) <= 0 || read(fd, &ch, 1) != 1) {
+			return false;
+		}
+		if (ch == '\n') {
+			return true;
+		}
+		line += ch;
+	}
+}
+
+// first moves right after the opening. Returns 1 if first wins, -1 if second wins and 0 for a draw.
+// An illegal move, a crash or a timeout loses the game.
+int referee_game(const engine_params_t& first, const engine_params_t& second, const movelist_t& opening, const match_settings_t& s, unsigned long seed) {
+	int player = opening.size() % 2 == 0 ? 1 : -1; // The first player is 1
 	board_t b;
 	init_board(b);
-	move_t last_move = 4 * 9 + 4;
-	apply_move(b, last_move, 1);
-	int player = 1;
-
-	while (!is_won(b)) {
-		move_t m;
-		auto t = now();
-		if (player == me) {
-			FPU_C = 1.3f;
-			C = 0.5f;
-			m = get_best_move(b, last_move, player);//IDDFS(b, last_move, player);
+	for (int i = 0; i + 1 < (int)opening.size(); i++) {
+		apply_move(b, opening[i], i % 2 == 0 ? 1 : -1);
+	}
+	move_t last_move = opening.empty() ? NULL_MOVE : opening.back();
+	// first reads the last opening move itself, second starts after it
+	engine_process_t engines[2];
+	engines[0] = spawn_engine(first, s, 2 * seed, b, opening.empty() ? player : -player);
+	if (last_move != NULL_MOVE) {
+		apply_move(b, last_move, -player);
+	}
+	engines[1] = spawn_engine(second, s, 2 * seed + 1, b, player);
+	TimePoint timeout = s.playouts ? MATCH_PLAYOUTS_TIMEOUT : MATCH_TIMEOUT_FACTOR * s.move_ms;
+	int side = 0;
+	int result;
+	send_move(engines[0], last_move);
+	while (1) {
+		std::string line;
+		int row;
+		int col;
+		movelist_t legal = last_move == NULL_MOVE ? get_all_moves() : moves(b, last_move);
+		if (!read_line(engines[side].out, line, timeout) || sscanf(line.c_str(), "%d %d", &row, &col) != 2
+			|| row < 0 || row >= 9 || col < 0 || col >= 9 || std::find(legal.begin(), legal.end(), row * 9 + col) == legal.end()) {
+			result = side == 0 ? -1 : 1;
+			break;
+		}
+		last_move = row * 9 + col;
+		apply_move(b, last_move, player);
+		int status = get_status(b);
+		if (status != NOT_OVER) {
+			result = status == 0 ? 0 : status == play_id_table[player + 1] ? 1 - 2 * side : 2 * side - 1;
+			break;
 		}
-		else {
-			FPU_C = 1.2f;
-			C = 0.6f;
-			m = get_best_move(b, last_move, player);//play_tournament(b, last_move, player, zobrist_key);
-		}
-		/*
-		if(now() - t > 50) {
-		cerr << "BON CEST PAS OUF TOUT CA de " << (now() - t - 50);
-		int a;
-		cin >> a;
-		}
-		*/
-		apply_move(b, m, player);
-		last_move = m;
-		//print_wholeboard_filled(b);
 		player = -player;
+		side ^= 1;
+		send_move(engines[side], last_move);
 	}
-	print_wholeboard_filled(b);
+	stop_engine(engines[0]);
+	stop_engine(engines[1]);
+	return result;
+}
 
-	int status = get_status(b);
-	if (status == 0) {
-		int forW = 0;
-		int forB = 0;
-		for (int i = 0; i < 9; i++) {
-			int st = state_from_miniboard[b[i]];
-			if (st == 2)
-				forB++;
-			if (st == 1)
-				forW++;
+// Random openings of plies moves whose side to move is neither clearly winning nor losing
+std::vector<movelist_t> generate_openings(int count, int plies, unsigned long seed) {
+	std::vector<movelist_t> openings;
+	std::mt19937 rng(seed);
+	while ((int)openings.size() < count) {
+		board_t b;
+		init_board(b);
+		movelist_t opening;
+		move_t last_move = NULL_MOVE;
+		int player = 1;
+		while ((int)opening.size() < plies && get_status(b) == NOT_OVER) {
+			movelist_t legal = last_move == NULL_MOVE ? get_all_moves() : moves(b, last_move);
+			last_move = legal[rng() % legal.size()];
+			apply_move(b, last_move, player);
+			opening.push_back(last_move);
+			player = -player;
+		}
+		if (get_status(b) != NOT_OVER) {
+			continue;
+		}
+		reset_arena(0);
+		node_t root = allocate(1);
+		init_node(root, last_move, -player);
+		time_manager_t tm;
+		init_fixed_playouts(tm, OPENING_CHECK_PLAYOUTS);
+		run_search(root, b, 1, tm);
+		node_t first = MEMORY[root].child;
+		node_t best = first;
+		for (node_t child = first; child < first + MEMORY[root].nchild; child++) {
+			if (VISITS[child] > VISITS[best]) {
+				best = child;
+			}
+		}
+		float mean = node_mean(best);
+		if (plies == 0 || (mean >= OPENING_MIN_MEAN && mean <= OPENING_MAX_MEAN)) {
+			openings.push_back(opening);
 		}
-		if (forW > forB)
-			return 1;
-		if (forB > forW)
-			return -1;
-		return 0;
 	}
-	if (status == 2)
-		status = -1;
-	if (status == me)
-		return 1;
-	return -1;
+	reset_arena(0);
+	reset_tree();
+	return openings;
 }
 
-void play_games(int n) {
-	int winsMe = 0;
-	int winsHim = 0;
-	int ties = 0;
-	int me = 1;
-	for (int i = 0; i < n; i++) {
-		int res = play_tour(me);
-		if (res == 0) {
-			ties += 1;
+inline double elo_to_score(double elo) {
+	return 1 / (1 + std::pow(10, -elo / 400));
+}
+
+inline double score_to_elo(double score) {
+	return -400 * std::log10(1 / score - 1);
+}
+
+// Log likelihood ratio of elo1 against elo0, normal approximation of the trinomial model
+double sprt_llr(int wins, int draws, int losses, double elo0, double elo1) {
+	double n = wins + draws + losses;
+	double score = (wins + draws * 0.5) / n;
+	double variance = (wins + draws * 0.25) / n - score * score;
+	if (variance <= 0) {
+		return 0; // Every game had the same result so far
+	}
+	double s0 = elo_to_score(elo0);
+	double s1 = elo_to_score(elo1);
+	return n * (s1 - s0) * (2 * score - s0 - s1) / (2 * variance);
+}
+
+void print_match(int wins, int draws, int losses, double llr, double lower, double upper) {
+	double n = wins + draws + losses;
+	double score = (wins + draws * 0.5) / n;
+	double variance = (wins + draws * 0.25) / n - score * score;
+	double margin = 1.96 * std::sqrt(variance / n);
+	double clamp = 0.5 / n; // Keeps a perfect score finite
+	double lo = score_to_elo(std::min(std::max(score - margin, clamp), 1 - clamp));
+	double hi = score_to_elo(std::min(std::max(score + margin, clamp), 1 - clamp));
+	double elo = score_to_elo(std::min(std::max(score, clamp), 1 - clamp));
+	cerr << "games " << n << " +" << wins << "-" << losses << "=" << draws << " elo " << elo << " [" << lo << ", " << hi << "]"
+		<< " llr " << llr << " (" << lower << ", " << upper << ")" << endl;
+}
+
+// Plays a against b, each opening twice with colors swapped
+void play_match(const engine_params_t& a, const engine_params_t& b, const match_settings_t& s) {
+	std::vector<movelist_t> openings = generate_openings((s.games + 1) / 2, s.opening_plies, 1);
+	std::vector<pid_t> workers;
+	std::vector<pollfd> fds;
+	for (int w = 0; w < s.concurrency; w++) {
+		int results[2];
+		if (pipe(results)) {
+			perror("pipe");
+			exit(1);
+		}
+		cout.flush();
+		cerr.flush();
+		pid_t pid = fork();
+		if (pid == 0) {
+			// Own process group, the parent kills the worker and its engines at once
+			setpgid(0, 0);
+			signal(SIGPIPE, SIG_IGN);
+			close(results[0]);
+			for (int game = w; game < s.games; game += s.concurrency) {
+				const movelist_t& opening = openings[game / 2];
+				int result = game % 2 == 0 ? referee_game(a, b, opening, s, game) : -referee_game(b, a, opening, s, game);
+				match_result_t r = { game, result };
+				if (write(results[1], &r, sizeof(r)) != sizeof(r)) {
+					break;
+				}
+			}
+			_exit(0);
+		}
+		setpgid(pid, pid);
+		close(results[1]);
+		workers.push_back(pid);
+		fds.push_back({ results[0], POLLIN, 0 });
+	}
+	double lower = std::log(s.beta / (1 - s.alpha));
+	double upper = std::log((1 - s.beta) / s.alpha);
+	int wins = 0;
+	int draws = 0;
+	int losses = 0;
+	double llr = 0;
+	int open = s.concurrency;
+	while (open > 0 && llr > lower && llr < upper) {
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			break;
+		}
+		for (pollfd& p : fds) {
+			if (p.fd < 0 || !p.revents) {
+				continue;
+			}
+			match_result_t r;
+			if (read(p.fd, &r, sizeof(r)) != sizeof(r)) {
+				close(p.fd);
+				p.fd = -1;
+				open--;
+				continue;
+			}
+			wins += r.result == 1;
+			draws += r.result == 0;
+			losses += r.result == -1;
+			llr = sprt_llr(wins, draws, losses, s.elo0, s.elo1);
+			print_match(wins, draws, losses, llr, lower, upper);
 		}
-		if (res == 1) {
-			winsMe += 1;
+	}
+	for (int i = 0; i < s.concurrency; i++) {
+		killpg(workers[i], SIGKILL);
+		waitpid(workers[i], nullptr, 0);
+		if (fds[i].fd >= 0) {
+			close(fds[i].fd);
 		}
-		if (res == -1) {
-			winsHim += 1;
+	}
+	if (llr >= upper) {
+		cerr << "H1 accepted: a is at least " << s.elo1 << " elo stronger" << endl;
+	}
+	else if (llr <= lower) {
+		cerr << "H0 accepted: a is at most " << s.elo0 << " elo stronger" << endl;
+	}
+	else {
+		cerr << "no decision" << endl;
+	}
+}
+
+// Tactical against uniform rollouts: rollout speed on the bench positions, then matches at equal
+// playouts for the value of a rollout and at equal time per move for the strength per CPU millisecond
+void bench_rollout_policy(int games, int playouts, TimePoint move_ms) {
+	const int rollouts = 200000;
+	bool dispatched = TACTICAL_ROLLOUTS;
+	for (bool tactical : { false, true }) {
+		TACTICAL_ROLLOUTS = tactical;
+		for (const bench_position_t& p : BENCH_POSITIONS) {
+			game_t game;
+			init_game(game, p.b);
+			int wins[3] = { 0, 0, 0 };
+			auto tim = now();
+			for (int i = 0; i < rollouts; i++) {
+				wins[simulate(game, p.last_move, p.player)]++;
+			}
+			auto time = std::max<TimePoint>(now() - tim, 1);
+			cerr << (tactical ? "tactical " : "uniform ") << p.name << " kpps " << rollouts / time << " results " << wins[0] << "/" << wins[1] << "/" << wins[2] << endl;
 		}
-		int color = me == 1 ? 1 : 2;
-		cerr << "Turn " << i << " I played as " << color << " scores for me: +" << winsMe << "-" << winsHim << "=" << ties << endl;
-		me *= -1;
 	}
+	TACTICAL_ROLLOUTS = dispatched;
+	engine_params_t tactical = current_params();
+	engine_params_t uniform = current_params();
+	tactical.tactical_rollouts = true;
+	uniform.tactical_rollouts = false;
+	int concurrency = std::thread::hardware_concurrency();
+	cerr << "equal playouts " << playouts << endl;
+	play_match(tactical, uniform, { games, concurrency, playouts, 0, 4, -10, 10, 0.05, 0.05 });
+	cerr << "equal time " << move_ms << "ms" << endl;
+	play_match(tactical, uniform, { games, concurrency, 0, move_ms, 4, -10, 10, 0.05, 0.05 });
 }
 
 // Main
 
 int main()
 {
-	cerr << "OBJ_SIZE " << OBJ_SIZE << endl;
 	init_precalculations();
+	init_cpu_dispatch();
+	init_arena(ARENA_BYTES, PREFAULT_ARENA ? THREADS : 0);
+	cerr << "arena nodes " << (long long)NB_CHUNKS * CHUNK_SIZE << " huge pages " << (explicit_huge_maps ? "explicit" : HUGE_PAGES ? "transparent" : "off") << endl;
 #ifndef AT_HOME
-	play_CG();
+	board_t b;
+	init_board(b);
+	play_CG(b, 1, true);
 #else
-	//play_games(100);
 	bench();
+	//engine_params_t tuned = current_params();
+	//tuned.c = 0.6f;
+	//play_match(tuned, current_params(), { 20000, (int)std::thread::hardware_concurrency(), 2000, 100, 4, 0, 5, 0.05, 0.05 });
+	//bench_threads(std::thread::hardware_concurrency());
+	//bench_rollouts();
+	//bench_rollout_policy(2000, 2000, 30);
+	//build_book(BOOK_FILE, 4, 3, 1000);
+	//perft_suite(5);
 #endif
 }